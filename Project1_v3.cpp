@@ -3,618 +3,5971 @@
 #include <vector>
 #include <cstring>
 #include <algorithm>
+#include <array>
 #include <cmath>
+#include <complex>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <cassert>
+#include <limits>
+#include <type_traits>
+#include <cstdio>
+#include <cerrno>
+#include <sstream>
+#include <functional>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+#ifdef _WIN32
+#include <io.h>
+#include <direct.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
+// PROFILER
+// Off unless PGM_TRACE names an output file (or --trace FILE is given). When
+// on, ProfileScope records wall time, pixels processed, pixel memory allocated
+// and the peak of live pixel memory for each operation and phase (parse,
+// render, compute, write). At exit a Chrome trace (open in chrome://tracing or
+// ui.perfetto.dev) is written and a summary table printed to stderr. When off
+// a scope costs one test of a global flag. Allocated bytes count only blocks
+// taken from the system, not those reused from the tile pool.
+struct ProfileEvent {
+    string name;
+    const char* phase;
+    int thread;
+    double start, duration;     // microseconds since the profiler started
+    long long pixels, allocated, peak;
+};
+
+struct Profiler {
+    static bool enabled;
+    static string traceFile;
+    static chrono::steady_clock::time_point origin;
+    static atomic<long long> liveBytes, peakBytes, allocatedBytes;
+    static mutex eventsMutex;
+    static vector<ProfileEvent> events;
+
+    static void start(const string& fileName) {
+        if (enabled)
+            return;
+        traceFile = fileName;
+        origin = chrono::steady_clock::now();
+        enabled = true;
+        atexit(finish);
+    }
+
+    static double now() {
+        return chrono::duration<double, micro>(chrono::steady_clock::now() - origin).count();
+    }
+
+    static int threadIndex() {
+        static atomic<int> nextIndex{ 0 };
+        thread_local int index = nextIndex++;
+        return index;
+    }
+
+    // Fresh blocks come from the system; the others are reused from the TilePool
+    static void recordAllocation(long long bytes, bool fresh) {
+        if (fresh)
+            allocatedBytes += bytes;
+        long long live = liveBytes += bytes;
+        long long peak = peakBytes;
+        while (live > peak && !peakBytes.compare_exchange_weak(peak, live)) {}
+    }
+
+    static void recordRelease(long long bytes) {
+        liveBytes -= bytes;
+    }
+
+    static void finish() {
+        lock_guard<mutex> lock(eventsMutex);
+        FILE* out = fopen(traceFile.c_str(), "w");
+        if (out == nullptr)
+            cerr << "trace: cannot write " << traceFile << endl;
+        else {
+            fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+            for (size_t i = 0; i < events.size(); i++) {
+                const ProfileEvent& e = events[i];
+                string name;
+                for (char c : e.name)
+                    if (c != '"' && c != '\\')
+                        name += c;
+                fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"args\":{\"pixels\":%lld,\"allocated_bytes\":%lld,\"peak_bytes\":%lld}}",
+                    i == 0 ? "" : ",", name.c_str(), e.phase, e.thread, e.start, e.duration, e.pixels, e.allocated, e.peak);
+                fprintf(out, ",\n{\"name\":\"pixel memory\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{\"peak_bytes\":%lld}}",
+                    e.start + e.duration, e.peak);
+            }
+            fprintf(out, "\n]}\n");
+            fclose(out);
+        }
+
+        // One line per (phase, name) in order of first appearance
+        struct Total {
+            string name;
+            const char* phase;
+            int calls = 0;
+            double milliseconds = 0;
+            long long pixels = 0, allocated = 0, peak = 0;
+        };
+        vector<Total> totals;
+        for (const ProfileEvent& e : events) {
+            auto total = find_if(totals.begin(), totals.end(), [&](const Total& t) {
+                return t.name == e.name && strcmp(t.phase, e.phase) == 0;
+            });
+            if (total == totals.end()) {
+                totals.push_back(Total());
+                total = totals.end() - 1;
+                total->name = e.name;
+                total->phase = e.phase;
+            }
+            total->calls++;
+            total->milliseconds += e.duration / 1000.0;
+            total->pixels += e.pixels;
+            total->allocated += e.allocated;
+            total->peak = max(total->peak, e.peak);
+        }
+
+        fprintf(stderr, "\n%-8s %-24s %7s %12s %10s %10s %12s %12s\n",
+            "phase", "operation", "calls", "total ms", "mean ms", "MP/s", "alloc MB", "peak MB");
+        for (const Total& t : totals)
+            fprintf(stderr, "%-8s %-24s %7d %12.3f %10.3f %10.1f %12.2f %12.2f\n",
+                t.phase, t.name.c_str(), t.calls, t.milliseconds, t.milliseconds / t.calls,
+                t.milliseconds > 0 ? t.pixels / 1000.0 / t.milliseconds : 0.0,
+                t.allocated / 1048576.0, t.peak / 1048576.0);
+        fprintf(stderr, "trace written to %s\n", traceFile.c_str());
+    }
+};
+
+bool Profiler::enabled = false;
+string Profiler::traceFile;
+chrono::steady_clock::time_point Profiler::origin;
+atomic<long long> Profiler::liveBytes{ 0 }, Profiler::peakBytes{ 0 }, Profiler::allocatedBytes{ 0 };
+mutex Profiler::eventsMutex;
+vector<ProfileEvent> Profiler::events;
+
+// Records the enclosing block. The peak is the highest live pixel memory seen
+// while the scope is open, including nested scopes.
+struct ProfileScope {
+    const char* name = nullptr;
+    const char* phase = nullptr;
+    long long pixels = 0, allocatedBefore = 0, outerPeak = 0;
+    double start = 0;
+
+    ProfileScope(const char* scopeName, const char* scopePhase, long long scopePixels = 0) {
+        if (!Profiler::enabled)
+            return;
+        name = scopeName;
+        phase = scopePhase;
+        pixels = scopePixels;
+        allocatedBefore = Profiler::allocatedBytes;
+        outerPeak = Profiler::peakBytes.exchange(Profiler::liveBytes);
+        start = Profiler::now();
+    }
+
+    ~ProfileScope() {
+        if (name == nullptr)
+            return;
+        ProfileEvent event{ name, phase, Profiler::threadIndex(), start, Profiler::now() - start, pixels,
+            Profiler::allocatedBytes - allocatedBefore, Profiler::peakBytes };
+        long long peak = event.peak;
+        while (outerPeak > peak && !Profiler::peakBytes.compare_exchange_weak(peak, outerPeak)) {}
+
+        lock_guard<mutex> lock(Profiler::eventsMutex);
+        Profiler::events.push_back(move(event));
+    }
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+};
+
+// TILE POOL
+// Blocks of freed tiles are kept by size and handed out again. An operation
+// that replaces the image with a new plane of the same size then reuses the
+// blocks of the plane before last (ping-pong), so a chain of filters settles
+// into allocating nothing and touching no fresh pages. At most Capacity bytes
+// are kept; beyond that blocks go back to the system. Scratch inside the row
+// kernels (convolution rings, resampling bands, running sums, median
+// histograms) is reused the same way through thread_local vectors that keep
+// their capacity.
+struct TilePool {
+    static constexpr size_t Alignment = 64;
+    static constexpr size_t Capacity = static_cast<size_t>(256) << 20;
+
+    mutex lock;
+    map<size_t, vector<unsigned char*>> freeBlocks;
+    size_t pooledBytes = 0;
+
+    // Never destroyed, so tiles released during exit still have a pool
+    static TilePool& instance() {
+        static TilePool* pool = new TilePool();
+        return *pool;
+    }
+
+    // Returns a pooled block of exactly bytes, or nullptr
+    unsigned char* take(size_t bytes) {
+        lock_guard<mutex> guard(lock);
+        auto blocks = freeBlocks.find(bytes);
+        if (blocks == freeBlocks.end() || blocks->second.empty())
+            return nullptr;
+        unsigned char* block = blocks->second.back();
+        blocks->second.pop_back();
+        pooledBytes -= bytes;
+        return block;
+    }
+
+    void give(unsigned char* block, size_t bytes) {
+        {
+            lock_guard<mutex> guard(lock);
+            if (pooledBytes + bytes <= Capacity) {
+                freeBlocks[bytes].push_back(block);
+                pooledBytes += bytes;
+                return;
+            }
+        }
+        ::operator delete(block, align_val_t(Alignment));
+    }
+};
+
+// PIXEL BUFFER
+// Row-major pixel store split into tiles of TileRows rows. Each tile is a
+// reference-counted block. Buffers from allocate() come from the pool, so
+// every row starts on a 64-byte boundary and stride (in bytes) may be larger
+// than cols * bytesPerPixel. Buffers from wrap() (a mapped P5 raster) keep the
+// source's stride of cols * bytesPerPixel, so their rows carry no alignment
+// guarantee; the row kernels only use unaligned loads and stores on pixels.
+// Pixels are 8-bit when maxGray fits in a byte and 16-bit otherwise.
+//
+// Copies share tiles (copy on write), so copies and snapshots cost one pointer
+// per tile. Neither row() detaches: code that writes a buffer it did not just
+// allocate must call makeUnique() first, which gives every tile someone else
+// still holds its own block. The non-const row() asserts that its tile is not
+// shared, so reads of a buffer that may be shared go through a const reference.
+// Reads never copy and are safe from any thread.
+struct PixelBuffer {
+    static constexpr size_t Alignment = TilePool::Alignment;
+    static constexpr int TileShift = 6;
+    static constexpr int TileRows = 1 << TileShift;
+
+    vector<shared_ptr<unsigned char>> tiles;
+    int rows = 0, cols = 0;
+    int bytesPerPixel = 1;
+    size_t stride = 0;
+
+    // Tiles come from the TilePool when it has a block of the size and go
+    // back to it when their last owner lets go
+    static shared_ptr<unsigned char> allocateTile(size_t bytes) {
+        unsigned char* block = TilePool::instance().take(bytes);
+        bool fresh = block == nullptr;
+        if (fresh)
+            block = static_cast<unsigned char*>(::operator new(bytes, align_val_t(TilePool::Alignment)));
+
+        bool tracked = Profiler::enabled;
+        if (tracked)
+            Profiler::recordAllocation(bytes, fresh);
+        return shared_ptr<unsigned char>(block, [bytes, tracked](unsigned char* p) {
+            if (tracked)
+                Profiler::recordRelease(bytes);
+            TilePool::instance().give(p, bytes);
+        });
+    }
+
+    void allocate(int newRows, int newCols, int newBytesPerPixel, bool zeroFill = true) {
+        rows = max(newRows, 0);
+        cols = max(newCols, 0);
+        bytesPerPixel = newBytesPerPixel;
+
+        size_t rowBytes = static_cast<size_t>(cols) * bytesPerPixel;
+        stride = (rowBytes + Alignment - 1) / Alignment * Alignment;
+
+        tiles.clear();
+        if (stride == 0 || rows == 0)
+            return;
+
+        tiles.resize((rows + TileRows - 1) >> TileShift);
+        for (size_t t = 0; t < tiles.size(); t++) {
+            tiles[t] = allocateTile(tileBytes(t));
+            if (zeroFill)
+                memset(tiles[t].get(), 0, tileBytes(t));
+        }
+    }
+
+    // Points the buffer at memory owned elsewhere (e.g. a file mapping). Each
+    // tile gets its own count that keeps owner alive, so a freshly wrapped
+    // buffer is written in place.
+    void wrap(shared_ptr<unsigned char> owner, unsigned char* pixels, int newRows, int newCols, int newBytesPerPixel, size_t newStride) {
+        rows = newRows;
+        cols = newCols;
+        bytesPerPixel = newBytesPerPixel;
+        stride = newStride;
+
+        tiles.clear();
+        if (stride == 0 || rows == 0)
+            return;
+
+        tiles.resize((rows + TileRows - 1) >> TileShift);
+        for (size_t t = 0; t < tiles.size(); t++)
+            tiles[t] = shared_ptr<unsigned char>(pixels + t * TileRows * stride, [owner](unsigned char*) {});
+    }
+
+    size_t tileBytes(size_t t) const {
+        return static_cast<size_t>(min(TileRows, rows - static_cast<int>(t) * TileRows)) * stride;
+    }
+
+    void detach(size_t t) {
+        shared_ptr<unsigned char> copy = allocateTile(tileBytes(t));
+        memcpy(copy.get(), tiles[t].get(), tileBytes(t));
+        tiles[t] = move(copy);
+    }
+
+    void makeUnique() {
+        for (size_t t = 0; t < tiles.size(); t++)
+            if (tiles[t].use_count() > 1)
+                detach(t);
+    }
+
+    bool empty() const {
+        return tiles.empty();
+    }
+
+    template <typename T>
+    T* row(int r) {
+        assert(tiles[r >> TileShift].use_count() == 1);
+        return reinterpret_cast<T*>(tiles[r >> TileShift].get() + (r & (TileRows - 1)) * stride);
+    }
+
+    template <typename T>
+    const T* row(int r) const {
+        return reinterpret_cast<const T*>(tiles[r >> TileShift].get() + (r & (TileRows - 1)) * stride);
+    }
+
+    int get(int r, int c) const {
+        return bytesPerPixel == 1 ? row<uint8_t>(r)[c] : row<uint16_t>(r)[c];
+    }
+};
+
+inline int bytesForMaxGray(int maxGray) {
+    return maxGray > 255 ? 2 : 1;
+}
+
+// PGM stores 16-bit samples most significant byte first
+constexpr bool hostIsBigEndian() {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Calls f with a zero of the pixel element type, so a kernel is written once as a
+// generic lambda and instantiated for both 8-bit and 16-bit buffers.
+template <typename F>
+void dispatchPixels(int bytesPerPixel, F&& f) {
+    if (bytesPerPixel == 1)
+        f(uint8_t(0));
+    else
+        f(uint16_t(0));
+}
+
+template <typename T>
+inline T clampPixel(int value, int maxGray) {
+    return static_cast<T>(value < 0 ? 0 : (value > maxGray ? maxGray : value));
+}
+
+// THREAD POOL
+// Work-stealing pool. A job is a numbered set of tasks; each participant owns a
+// deque seeded with a contiguous run of task numbers, takes its own from the
+// front and, once that is empty, steals from the back of the others. The
+// calling thread takes part as participant 0, and calls made from inside a task
+// run inline, so a pool of one thread is plain sequential code.
+struct ThreadPool {
+    struct Task {
+        int index;
+        const function<void(int)>* body;
+    };
+
+    struct WorkQueue {
+        mutex lock;
+        deque<Task> tasks;
+    };
+
+    vector<thread> workers;
+    vector<unique_ptr<WorkQueue>> queues;
+    mutex jobLock, wakeLock, doneLock;
+    condition_variable wake, done;
+    atomic<int> remaining{ 0 };
+    unsigned generation = 0;
+    bool stopping = false;
+
+    static ThreadPool& instance() {
+        static ThreadPool pool(thread::hardware_concurrency());
+        return pool;
+    }
+
+    explicit ThreadPool(unsigned threadCount) {
+        start(threadCount);
+    }
+
+    ~ThreadPool() {
+        stop();
+    }
+
+    int threadCount() const {
+        return static_cast<int>(queues.size());
+    }
+
+    void resize(unsigned threadCount) {
+        lock_guard<mutex> job(jobLock);
+        stop();
+        start(threadCount);
+    }
+
+    void start(unsigned threadCount) {
+        threadCount = max(1u, threadCount);
+        stopping = false;
+        queues.clear();
+        for (unsigned q = 0; q < threadCount; q++)
+            queues.push_back(make_unique<WorkQueue>());
+        for (unsigned q = 1; q < threadCount; q++)
+            workers.emplace_back([this, q] { workerLoop(static_cast<int>(q)); });
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> lock(wakeLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (thread& worker : workers)
+            worker.join();
+        workers.clear();
+    }
+
+    static bool& insideTask() {
+        thread_local bool inside = false;
+        return inside;
+    }
+
+    // Runs body(0) ... body(taskCount - 1) and returns when all have finished
+    void run(int taskCount, const function<void(int)>& body) {
+        if (taskCount <= 0)
+            return;
+        if (queues.size() == 1 || taskCount == 1 || insideTask()) {
+            for (int t = 0; t < taskCount; t++)
+                body(t);
+            return;
+        }
+
+        lock_guard<mutex> job(jobLock);
+        remaining = taskCount;
+        int queueCount = static_cast<int>(queues.size());
+        for (int q = 0; q < queueCount; q++) {
+            lock_guard<mutex> lock(queues[q]->lock);
+            int first = static_cast<int>(static_cast<long long>(taskCount) * q / queueCount);
+            int last = static_cast<int>(static_cast<long long>(taskCount) * (q + 1) / queueCount);
+            for (int t = first; t < last; t++)
+                queues[q]->tasks.push_back({ t, &body });
+        }
+        {
+            lock_guard<mutex> lock(wakeLock);
+            generation++;
+        }
+        wake.notify_all();
+
+        work(0);
+
+        unique_lock<mutex> lock(doneLock);
+        done.wait(lock, [this] { return remaining.load() == 0; });
+    }
+
+    bool takeTask(int self, Task& task) {
+        WorkQueue& own = *queues[self];
+        {
+            lock_guard<mutex> lock(own.lock);
+            if (!own.tasks.empty()) {
+                task = own.tasks.front();
+                own.tasks.pop_front();
+                return true;
+            }
+        }
+
+        int queueCount = static_cast<int>(queues.size());
+        for (int offset = 1; offset < queueCount; offset++) {
+            WorkQueue& victim = *queues[(self + offset) % queueCount];
+            lock_guard<mutex> lock(victim.lock);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.back();
+                victim.tasks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(int self) {
+        insideTask() = true;
+        Task task;
+        while (takeTask(self, task)) {
+            (*task.body)(task.index);
+            if (remaining.fetch_sub(1) == 1) {
+                lock_guard<mutex> lock(doneLock);
+                done.notify_all();
+            }
+        }
+        insideTask() = false;
+    }
+
+    void workerLoop(int self) {
+        unsigned seen = 0;
+        for (;;) {
+            {
+                unique_lock<mutex> lock(wakeLock);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping)
+                    return;
+                seen = generation;
+            }
+            work(self);
+        }
+    }
+};
+
+// Sets the number of threads used by the image operations (0 = one per core)
+void setThreadCount(unsigned threadCount) {
+    ThreadPool::instance().resize(threadCount == 0 ? thread::hardware_concurrency() : threadCount);
+}
+
+// Splits rows [0, rows) into bands and runs body(rowBegin, rowEnd) for each on
+// the pool. Bands aim at a cache-sized slice of rowBytes-wide rows, are never
+// shorter than four times the kernel halo (every band re-reads its halo rows)
+// and are cut further to give each thread about four bands to balance. Row
+// kernels compute each output row independently of where the bands fall, so
+// the result does not depend on the thread count.
+void parallelRows(int rows, size_t rowBytes, int halo, const function<void(int, int)>& body) {
+    const size_t bandBytes = 256 * 1024;
+    ThreadPool& pool = ThreadPool::instance();
+
+    long long band = max<long long>(1, static_cast<long long>(bandBytes / max<size_t>(rowBytes, 1)));
+    band = max<long long>(band, 4LL * halo);
+    long long balanced = (rows + 4LL * pool.threadCount() - 1) / (4LL * pool.threadCount());
+    band = max<long long>(1, min(band, balanced));
+
+    int bandCount = static_cast<int>((rows + band - 1) / band);
+    pool.run(bandCount, [&](int t) {
+        int rowBegin = static_cast<int>(t * band);
+        body(rowBegin, static_cast<int>(min<long long>(rows, rowBegin + band)));
+    });
+}
+
+// TRANSPOSE AND MIRROR
+#ifdef __SSE2__
+// In-register transpose of a square block of n rows (16 bytes or 8 words).
+// Interleaving row k with row k + n/2 rotates the bits of the (row, column)
+// index by one; after log2(n) rounds rows and columns have swapped.
+template <typename T>
+inline void transposeRegisters(__m128i* r) {
+    const int n = 16 / sizeof(T);
+    __m128i t[16];
+    for (int round = (sizeof(T) == 1 ? 4 : 3); round > 0; round--) {
+        for (int k = 0; k < n / 2; k++) {
+            if (sizeof(T) == 1) {
+                t[2 * k] = _mm_unpacklo_epi8(r[k], r[k + n / 2]);
+                t[2 * k + 1] = _mm_unpackhi_epi8(r[k], r[k + n / 2]);
+            }
+            else {
+                t[2 * k] = _mm_unpacklo_epi16(r[k], r[k + n / 2]);
+                t[2 * k + 1] = _mm_unpackhi_epi16(r[k], r[k + n / 2]);
+            }
+        }
+        for (int k = 0; k < n; k++)
+            r[k] = t[k];
+    }
+}
+
+// Reverses the order of the 16 bytes or 8 words in a register
+template <typename T>
+inline __m128i reverseLanes(__m128i v) {
+    if (sizeof(T) == 1)
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    return _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+}
+#endif
+
+// out(r, c) = src(c, r) read through row pointer tables, which lets the callers
+// fold a flip of either image into the transpose. Work is split by output rows
+// (source columns); each band walks 64 x 64 tiles so both sides stay in cache,
+// and full SIMD blocks inside a tile are transposed in registers.
+template <typename T>
+void transposeRows(const vector<const T*>& srcRows, const vector<T*>& outRows, int srcCols) {
+    const int tile = 64;
+    int srcRowCount = static_cast<int>(srcRows.size());
+
+    parallelRows(srcCols, srcRowCount * sizeof(T), 0, [&](int colBegin, int colEnd) {
+        for (int i0 = 0; i0 < srcRowCount; i0 += tile) {
+            int i1 = min(i0 + tile, srcRowCount);
+            for (int j0 = colBegin; j0 < colEnd; j0 += tile) {
+                int j1 = min(j0 + tile, colEnd);
+                int i = i0;
+#ifdef __SSE2__
+                const int n = 16 / sizeof(T);
+                for (; i + n <= i1; i += n) {
+                    int j = j0;
+                    for (; j + n <= j1; j += n) {
+                        __m128i block[16];
+                        for (int k = 0; k < n; k++)
+                            block[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(srcRows[i + k] + j));
+                        transposeRegisters<T>(block);
+                        for (int k = 0; k < n; k++)
+                            _mm_storeu_si128(reinterpret_cast<__m128i*>(outRows[j + k] + i), block[k]);
+                    }
+                    for (; j < j1; j++)
+                        for (int k = 0; k < n; k++)
+                            outRows[j][i + k] = srcRows[i + k][j];
+                }
+#endif
+                for (; i < i1; i++) {
+                    const T* src = srcRows[i];
+                    for (int j = j0; j < j1; j++)
+                        outRows[j][i] = src[j];
+                }
+            }
+        }
+    });
+}
+
+// Reverses n pixels in place, a register of pixels from each end at a time
+template <typename T>
+void reverseRow(T* row, int n) {
+    int left = 0, right = n;
+#ifdef __SSE2__
+    const int lanes = 16 / sizeof(T);
+    for (; right - left >= 2 * lanes; left += lanes, right -= lanes) {
+        __m128i head = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + left));
+        __m128i tail = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + right - lanes));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(row + left), reverseLanes<T>(tail));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(row + right - lanes), reverseLanes<T>(head));
+    }
+#endif
+    reverse(row + left, row + right);
+}
+
+// FILE MAPPING
+// Private view of a whole file. Uses mmap where available and a single bulk
+// read otherwise, so parsers can scan the bytes without stream overhead. The
+// mapping is copy-on-write: pixels aliasing it can be edited in place and the
+// file on disk is never touched.
+struct MappedFile {
+    shared_ptr<const char> storage;
+    const char* data = nullptr;
+    size_t size = 0;
+
+    int open(const char* fileName) {
+#ifdef _WIN32
+        FILE* file = fopen(fileName, "rb");
+        if (file == nullptr)
+            return -1;
+        fseek(file, 0, SEEK_END);
+        long length = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        if (length < 0) {
+            fclose(file);
+            return -1;
+        }
+        char* block = new char[length + 1];
+        size = fread(block, 1, length, file);
+        fclose(file);
+        storage.reset(block, [](const char* p) { delete[] p; });
+        data = block;
+        return 0;
+#else
+        int fd = ::open(fileName, O_RDONLY);
+        if (fd < 0)
+            return -1;
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+            ::close(fd);
+            return -1;
+        }
+
+        size = static_cast<size_t>(info.st_size);
+        if (size == 0) {
+            ::close(fd);
+            storage.reset();
+            data = "";
+            return 0;
+        }
+
+        void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED)
+            return -1;
+        madvise(mapping, size, MADV_SEQUENTIAL);
+
+        size_t length = size;
+        storage.reset(static_cast<const char*>(mapping),
+            [length](const char* p) { munmap(const_cast<char*>(p), length); });
+        data = static_cast<const char*>(mapping);
+        return 0;
+#endif
+    }
+};
+
+// FILE WRITING
+struct WriteBlock {
+    const void* data;
+    size_t size;
+};
+
+// Output file descriptor that hands large blocks to the OS in as few calls as possible.
+// Regular files are written to a temporary file next to the target and renamed
+// over it by close(): the target may be the file an image was loaded from,
+// whose pixels still alias its mapping, so it must not be truncated while
+// they are read. Destroying the writer before close() leaves the target as it was.
+struct FileWriter {
+    int fd = -1;
+    bool ownsDescriptor = false;
+    string targetName, tempName;        // set while writing through a temporary file
+
+    FileWriter() = default;
+    FileWriter(const FileWriter&) = delete;
+    FileWriter& operator=(const FileWriter&) = delete;
+
+    ~FileWriter() {
+        discard();
+    }
+
+    int open(const char* fileName) {
+        ownsDescriptor = true;
+#ifdef _WIN32
+        // Windows loads files into memory, so nothing aliases the target
+        fd = _open(fileName, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+        // Devices and pipes (e.g. /dev/null) are written directly
+        struct stat info;
+        bool exists = stat(fileName, &info) == 0;
+        if (exists && !S_ISREG(info.st_mode)) {
+            fd = ::open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            return fd < 0 ? -1 : 0;
+        }
+
+        // A symbolic link keeps pointing at the file it names
+        char* resolved = realpath(fileName, nullptr);
+        targetName = resolved != nullptr ? resolved : fileName;
+        free(resolved);
+
+        static atomic<unsigned> counter(0);
+        tempName = targetName + ".tmp" + to_string(getpid()) + "." + to_string(counter++);
+        fd = ::open(tempName.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd < 0) {
+            tempName.clear();
+            targetName.clear();
+            return -1;
+        }
+        if (exists)
+            fchmod(fd, info.st_mode & 07777);
+#endif
+        return fd < 0 ? -1 : 0;
+    }
+
+    // Writes to a descriptor opened elsewhere (stdout, a pipe); close() leaves it open
+    void attach(int existingFd) {
+        fd = existingFd;
+        ownsDescriptor = false;
+#ifdef _WIN32
+        _setmode(fd, _O_BINARY);
+#endif
+    }
+
+    bool write(const void* data, size_t size) {
+        const char* p = static_cast<const char*>(data);
+        while (size > 0) {
+#ifdef _WIN32
+            int written = _write(fd, p, static_cast<unsigned>(min(size, static_cast<size_t>(1) << 30)));
+#else
+            ssize_t written = ::write(fd, p, size);
+            if (written < 0 && errno == EINTR)
+                continue;
+#endif
+            if (written <= 0)
+                return false;
+            p += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    // Gathers many blocks per writev call; partial writes finish with write()
+    bool writeBlocks(const WriteBlock* blocks, size_t count) {
+#ifdef _WIN32
+        for (size_t i = 0; i < count; i++)
+            if (!write(blocks[i].data, blocks[i].size))
+                return false;
+        return true;
+#else
+        const size_t maxVectors = 1024;
+        iovec vectors[maxVectors];
+
+        for (size_t first = 0; first < count; first += maxVectors) {
+            size_t batch = min(count - first, maxVectors);
+            size_t total = 0;
+            for (size_t i = 0; i < batch; i++) {
+                vectors[i].iov_base = const_cast<void*>(blocks[first + i].data);
+                vectors[i].iov_len = blocks[first + i].size;
+                total += blocks[first + i].size;
+            }
+
+            ssize_t written;
+            do {
+                written = writev(fd, vectors, static_cast<int>(batch));
+            } while (written < 0 && errno == EINTR);
+            if (written < 0)
+                return false;
+
+            size_t skip = static_cast<size_t>(written);
+            for (size_t i = 0; i < batch && skip < total; i++) {
+                const WriteBlock& block = blocks[first + i];
+                if (skip >= block.size) {
+                    skip -= block.size;
+                    total -= block.size;
+                    continue;
+                }
+                if (!write(static_cast<const char*>(block.data) + skip, block.size - skip))
+                    return false;
+                total -= block.size;
+                skip = 0;
+            }
+        }
+        return true;
+#endif
+    }
+
+    // Finishes the file; a temporary file replaces the target only now
+    int close() {
+        int result = 0;
+        if (fd >= 0 && ownsDescriptor) {
+#ifdef _WIN32
+            result = _close(fd);
+#else
+            result = ::close(fd);
+#endif
+        }
+        fd = -1;
+#ifndef _WIN32
+        if (!tempName.empty()) {
+            if (result == 0 && rename(tempName.c_str(), targetName.c_str()) != 0)
+                result = -1;
+            if (result != 0)
+                unlink(tempName.c_str());
+            tempName.clear();
+            targetName.clear();
+        }
+#endif
+        return result;
+    }
+
+    // Abandons an unfinished file: the temporary file goes, the target stays
+    void discard() {
+#ifndef _WIN32
+        if (!tempName.empty()) {
+            if (fd >= 0)
+                ::close(fd);
+            fd = -1;
+            unlink(tempName.c_str());
+            tempName.clear();
+            targetName.clear();
+        }
+#endif
+        close();
+    }
+};
+
+// PGM PARSING
+struct PGMHeader {
+    char magic[3] = "";
+    int cols = 0, rows = 0, maxGray = 0;
+    size_t dataOffset = 0;
+};
+
+// Reads the next header integer, skipping whitespace and '#' comments
+const char* scanHeaderValue(const char* p, const char* end, int& value) {
+    while (p < end) {
+        if (*p == '#') {
+            while (p < end && *p != '\n' && *p != '\r')
+                p++;
+        }
+        else if (static_cast<unsigned char>(*p) <= ' ')
+            p++;
+        else
+            break;
+    }
+
+    if (p == end || *p < '0' || *p > '9')
+        return nullptr;
+
+    long long result = 0;
+    while (p < end && *p >= '0' && *p <= '9' && result <= INT_MAX) {
+        result = result * 10 + (*p - '0');
+        p++;
+    }
+    if (result > INT_MAX)
+        return nullptr;
+
+    value = static_cast<int>(result);
+    return p;
+}
+
+// Parses "P? cols rows maxGray"; comments may appear between any two fields.
+// dataOffset points just past the single whitespace byte after maxGray.
+int parsePGMHeader(const char* data, size_t size, PGMHeader& header) {
+    const char* end = data + size;
+    if (size < 2 || data[0] != 'P')
+        return -2;
+
+    header.magic[0] = data[0];
+    header.magic[1] = data[1];
+    header.magic[2] = '\0';
+
+    const char* p = data + 2;
+    p = scanHeaderValue(p, end, header.cols);
+    if (p != nullptr)
+        p = scanHeaderValue(p, end, header.rows);
+    if (p != nullptr)
+        p = scanHeaderValue(p, end, header.maxGray);
+    if (p == nullptr || header.cols <= 0 || header.rows <= 0 || header.maxGray <= 0 || header.maxGray > 65535)
+        return -2;
+
+    if (p < end)
+        p++;
+    header.dataOffset = p - data;
+    return 0;
+}
+
+// Skips whitespace (and stray comments) and parses one unsigned decimal.
+// Returns the position after its digits, or nullptr if no number follows.
+// Values saturate instead of overflowing; callers clamp to maxGray.
+inline const char* scanPixelValue(const char* p, const char* end, uint32_t& value) {
+    while (p < end) {
+        if (*p == '#') {
+            while (p < end && *p != '\n' && *p != '\r')
+                p++;
+        }
+        else if (static_cast<unsigned char>(*p) <= ' ')
+            p++;
+        else
+            break;
+    }
+
+    if (p == end || *p < '0' || *p > '9')
+        return nullptr;
+
+    uint32_t result = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        if (result < 100000000)
+            result = result * 10 + (*p - '0');
+        p++;
+    }
+
+    value = result;
+    return p;
+}
+
+// Converts 1-8 ASCII digits starting at p with SWAR multiplies (no per-digit loop)
+inline uint32_t parseDigitRun(const char* p, unsigned length) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    word = (word & 0x0F0F0F0F0F0F0F0FULL) << (8 * (8 - length));
+    word = (word * 2561) >> 8;
+    word = ((word & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+    word = ((word & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+    return static_cast<uint32_t>(word);
+}
+
+// Parses one raster row. The SSE2 path classifies 16 bytes at a time and
+// converts every complete digit run in the window from the bit masks; anything
+// unusual (comments, long runs, the last bytes of the file) takes the scalar path.
+template <typename T>
+const char* parseP2Row(const char* p, const char* end, T* row, int cols, uint32_t limit) {
+    int c = 0;
+    while (c < cols) {
+#ifdef __SSE2__
+        // The 32-byte margin keeps the 8-byte digit loads inside the buffer
+        while (c < cols && end - p >= 32) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            __m128i shifted = _mm_sub_epi8(chunk, _mm_set1_epi8(static_cast<char>('0' + 128)));
+            unsigned digits = _mm_movemask_epi8(_mm_cmplt_epi8(shifted, _mm_set1_epi8(-128 + 10)));
+            unsigned spaces = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(chunk, _mm_set1_epi8(' ')), chunk));
+            if ((digits | spaces) != 0xFFFF)
+                break;
+
+            // A run touching the end of the window may continue; leave it for the next one
+            unsigned consumed = 16;
+            if (digits & 0x8000) {
+                unsigned gaps = ~digits & 0xFFFF;
+                if (gaps == 0)
+                    break;
+                consumed = 32 - __builtin_clz(gaps);
+                digits &= (1u << consumed) - 1;
+            }
+
+            unsigned starts = digits & ~(digits << 1);
+            unsigned position = 0;
+            bool longRun = false;
+            while (starts != 0 && c < cols) {
+                unsigned start = __builtin_ctz(starts);
+                unsigned length = __builtin_ctz(~(digits >> start));
+                if (length > 8) {
+                    longRun = true;
+                    position = start;
+                    break;
+                }
+                uint32_t value = parseDigitRun(p + start, length);
+                row[c++] = static_cast<T>(value > limit ? limit : value);
+                position = start + length;
+                starts &= starts - 1;
+            }
+
+            if (longRun || starts != 0) {
+                p += position;
+                break;
+            }
+            p += consumed;
+        }
+#endif
+        if (c == cols)
+            break;
+
+        uint32_t value;
+        p = scanPixelValue(p, end, value);
+        if (p == nullptr)
+            return nullptr;
+        row[c++] = static_cast<T>(value > limit ? limit : value);
+    }
+    return p;
+}
+
+// Parses the ASCII raster of a P2 file into pixels, clamping to maxGray
+bool parseP2Pixels(const char* p, const char* end, PixelBuffer& pixels, int maxGray) {
+    dispatchPixels(pixels.bytesPerPixel, [&](auto zero) {
+        using T = decltype(zero);
+        for (int r = 0; r < pixels.rows && p != nullptr; r++)
+            p = parseP2Row(p, end, pixels.row<T>(r), pixels.cols, static_cast<uint32_t>(maxGray));
+    });
+    return p != nullptr;
+}
+
+// Wraps the P5 raster in a PixelBuffer. 8-bit data (and 16-bit data on
+// big-endian hosts) aliases the private file mapping with no copy; 16-bit data
+// on little-endian hosts is byte-swapped into an aligned buffer.
+bool loadP5Pixels(const MappedFile& file, const PGMHeader& header, PixelBuffer& pixels) {
+    int bytesPerPixel = bytesForMaxGray(header.maxGray);
+    size_t rowBytes = static_cast<size_t>(header.cols) * bytesPerPixel;
+    if (header.dataOffset > file.size || (file.size - header.dataOffset) / rowBytes < static_cast<size_t>(header.rows))
+        return false;
+
+    unsigned char* raster = reinterpret_cast<unsigned char*>(const_cast<char*>(file.data + header.dataOffset));
+
+    if (bytesPerPixel == 1 || (hostIsBigEndian() && reinterpret_cast<uintptr_t>(raster) % 2 == 0)) {
+        // Samples above maxGray are clamped as in P2 files; the mapping is
+        // private, so only the pages holding one get copied
+        if (header.maxGray < (bytesPerPixel == 1 ? 255 : 65535))
+            dispatchPixels(bytesPerPixel, [&](auto zero) {
+                using T = decltype(zero);
+                const T limit = static_cast<T>(header.maxGray);
+                for (int r = 0; r < header.rows; r++) {
+                    T* row = reinterpret_cast<T*>(raster + r * rowBytes);
+                    for (int c = 0; c < header.cols; c++)
+                        if (row[c] > limit)
+                            row[c] = limit;
+                }
+            });
+        pixels.wrap(shared_ptr<unsigned char>(file.storage, raster), raster, header.rows, header.cols, bytesPerPixel, rowBytes);
+        return true;
+    }
+
+    pixels.allocate(header.rows, header.cols, 2, false);
+    for (int r = 0; r < header.rows; r++) {
+        const unsigned char* src = raster + r * rowBytes;
+        uint16_t* dst = pixels.row<uint16_t>(r);
+        for (int c = 0; c < header.cols; c++) {
+            int value = (src[2 * c] << 8) | src[2 * c + 1];
+            dst[c] = static_cast<uint16_t>(min(value, header.maxGray));
+        }
+    }
+    return true;
+}
+
+// PGM WRITING
+// Writes a P5 file: the header and every row go out in one writev for 8-bit
+// data (a block per tile when rows are unpadded); 16-bit data is byte-swapped
+// through a 4 MB staging buffer. writeP5Rows writes the rows after header,
+// which may be empty so a file can be written band by band.
+bool writeP5Rows(FileWriter& out, const PixelBuffer& pixels, const char* header, size_t headerLength) {
+    size_t rowBytes = static_cast<size_t>(pixels.cols) * pixels.bytesPerPixel;
+
+    if (pixels.bytesPerPixel == 1 || hostIsBigEndian()) {
+        vector<WriteBlock> blocks;
+        if (headerLength > 0)
+            blocks.push_back({ header, headerLength });
+        if (pixels.stride == rowBytes)
+            for (size_t t = 0; t < pixels.tiles.size(); t++)
+                blocks.push_back({ pixels.tiles[t].get(), pixels.tileBytes(t) });
+        else
+            for (int r = 0; r < pixels.rows; r++)
+                blocks.push_back({ pixels.row<unsigned char>(r), rowBytes });
+        return out.writeBlocks(blocks.data(), blocks.size());
+    }
+
+    if (headerLength > 0 && !out.write(header, headerLength))
+        return false;
+
+    vector<unsigned char> staging(max(static_cast<size_t>(1) << 22, rowBytes));
+    size_t used = 0;
+    for (int r = 0; r < pixels.rows; r++) {
+        if (used + rowBytes > staging.size()) {
+            if (!out.write(staging.data(), used))
+                return false;
+            used = 0;
+        }
+        const uint16_t* src = pixels.row<uint16_t>(r);
+        unsigned char* dst = staging.data() + used;
+        for (int c = 0; c < pixels.cols; c++) {
+            dst[2 * c] = static_cast<unsigned char>(src[c] >> 8);
+            dst[2 * c + 1] = static_cast<unsigned char>(src[c] & 0xFF);
+        }
+        used += rowBytes;
+    }
+    return out.write(staging.data(), used);
+}
+
+int formatPGMHeader(char* header, size_t size, const char* magic, int cols, int rows, int maxGray) {
+    return snprintf(header, size, "%s\n# This is a comment\n%d %d\n%d\n", magic, cols, rows, maxGray);
+}
+
+bool writeP5(FileWriter& out, const PixelBuffer& pixels, int maxGray) {
+    char header[64];
+    int headerLength = formatPGMHeader(header, sizeof(header), "P5", pixels.cols, pixels.rows, maxGray);
+    return writeP5Rows(out, pixels, header, headerLength);
+}
+
+// Appends value and a trailing space, two digits per step from a pair table
+inline char* appendPixelText(char* out, unsigned value) {
+    static const char digitPairs[201] =
+        "0001020304050607080910111213141516171819"
+        "2021222324252627282930313233343536373839"
+        "4041424344454647484950515253545556575859"
+        "6061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+
+    char text[8];
+    char* p = text + sizeof(text);
+    *--p = ' ';
+    while (value >= 100) {
+        unsigned pair = value % 100;
+        value /= 100;
+        p -= 2;
+        memcpy(p, digitPairs + 2 * pair, 2);
+    }
+    if (value >= 10) {
+        p -= 2;
+        memcpy(p, digitPairs + 2 * value, 2);
+    }
+    else
+        *--p = static_cast<char>('0' + value);
+
+    size_t length = text + sizeof(text) - p;
+    memcpy(out, p, length);
+    return out + length;
+}
+
+// Writes a P2 file through a reusable 1 MB text buffer, one write() per fill,
+// in the same layout as before: every value followed by a space, one row per line.
+// Like writeP5Rows, writeP2Rows puts header (possibly empty) before the rows.
+bool writeP2Rows(FileWriter& out, const PixelBuffer& pixels, const char* header) {
+    const size_t bufferSize = static_cast<size_t>(1) << 20;
+    const size_t maxPixelText = 6;
+    const int pixelsPerCheck = 1024;
+    static thread_local vector<char> buffer(bufferSize);
+
+    char* begin = buffer.data();
+    char* limit = begin + bufferSize;
+    char* p = begin + snprintf(begin, 64, "%s", header);
+    bool ok = true;
+
+    dispatchPixels(pixels.bytesPerPixel, [&](auto zero) {
+        using T = decltype(zero);
+        for (int r = 0; r < pixels.rows && ok; r++) {
+            const T* row = pixels.row<T>(r);
+            for (int c = 0; c < pixels.cols && ok; c += pixelsPerCheck) {
+                int last = min(c + pixelsPerCheck, pixels.cols);
+                if (static_cast<size_t>(limit - p) < (last - c) * maxPixelText + 1) {
+                    ok = out.write(begin, p - begin);
+                    p = begin;
+                }
+                for (int k = c; k < last; k++)
+                    p = appendPixelText(p, row[k]);
+            }
+            *p++ = '\n';
+        }
+    });
+
+    return ok && out.write(begin, p - begin);
+}
+
+bool writeP2(FileWriter& out, const PixelBuffer& pixels, int maxGray) {
+    char header[64];
+    formatPGMHeader(header, sizeof(header), "P2", pixels.cols, pixels.rows, maxGray);
+    return writeP2Rows(out, pixels, header);
+}
+
+// POINT OPERATIONS
+// Brightness, contrast stretching and thresholding map every gray level on its
+// own, so any run of them collapses into one table with an entry per value the
+// element type can hold (256 or 65536) and the image is streamed only once.
+struct PointOperation {
+    enum Kind { Brightness, ContrastStretch, Threshold };
+    Kind kind;
+    double value;
+};
+
+struct PointLUT {
+    vector<uint16_t> table;
+
+    // Starts as the identity mapping
+    explicit PointLUT(int bytesPerPixel) : table(static_cast<size_t>(1) << (8 * bytesPerPixel)) {
+        for (size_t v = 0; v < table.size(); v++)
+            table[v] = static_cast<uint16_t>(v);
+    }
+
+    // Each add* applies after what is already in the table (table = op o table)
+    void addBrightness(double factor, int maxGray) {
+        for (uint16_t& entry : table) {
+            double value = entry * factor;
+            entry = static_cast<uint16_t>(value >= maxGray ? maxGray : (value <= 0.0 ? 0 : value));
+        }
+    }
+
+    void addContrastStretch(int minPixelValue, int maxPixelValue, int maxGray) {
+        double factor = static_cast<double>(maxGray) / (maxPixelValue - minPixelValue);
+        for (uint16_t& entry : table) {
+            int value = min(max(static_cast<int>(entry), minPixelValue), maxPixelValue);
+            entry = static_cast<uint16_t>((value - minPixelValue) * factor);
+        }
+    }
+
+    void addThreshold(int threshold, int maxGray) {
+        for (uint16_t& entry : table)
+            entry = static_cast<uint16_t>(entry < threshold ? 0 : maxGray);
+    }
+
+    // One pass over the image; the 8-bit table is narrowed to 256 bytes first
+    void apply(PixelBuffer& pixels) const {
+        if (pixels.bytesPerPixel == 1) {
+            uint8_t narrow[256];
+            for (int v = 0; v < 256; v++)
+                narrow[v] = static_cast<uint8_t>(table[v]);
+            applyTable(pixels, narrow);
+        }
+        else
+            applyTable(pixels, table.data());
+    }
+
+    template <typename T>
+    static void applyTable(PixelBuffer& pixels, const T* lookup) {
+        pixels.makeUnique();
+        parallelRows(pixels.rows, static_cast<size_t>(pixels.cols) * sizeof(T), 0, [&](int rowBegin, int rowEnd) {
+            applyTableRows(pixels, lookup, rowBegin, rowEnd);
+        });
+    }
+
+    template <typename T>
+    static void applyTableRows(PixelBuffer& pixels, const T* lookup, int rowBegin, int rowEnd) {
+        for (int r = rowBegin; r < rowEnd; r++) {
+            T* row = pixels.row<T>(r);
+            int c = 0;
+            for (; c + 4 <= pixels.cols; c += 4) {
+                T a = lookup[row[c]], b = lookup[row[c + 1]];
+                T d = lookup[row[c + 2]], e = lookup[row[c + 3]];
+                row[c] = a;
+                row[c + 1] = b;
+                row[c + 2] = d;
+                row[c + 3] = e;
+            }
+            for (; c < pixels.cols; c++)
+                row[c] = lookup[row[c]];
+        }
+    }
+};
+
+// Smallest and largest pixel value, 16 bytes per SSE2 min/max step
+void pixelRange(const PixelBuffer& pixels, int& minPixelValue, int& maxPixelValue) {
+    minPixelValue = INT_MAX;
+    maxPixelValue = INT_MIN;
+
+    dispatchPixels(pixels.bytesPerPixel, [&](auto zero) {
+        using T = decltype(zero);
+        T lo = numeric_limits<T>::max(), hi = 0;
+        const int lanes = 16 / sizeof(T);
+
+        for (int r = 0; r < pixels.rows; r++) {
+            const T* row = pixels.row<T>(r);
+            int c = 0;
+#ifdef __SSE2__
+            if (pixels.cols >= lanes) {
+                // 16-bit lanes are biased by 0x8000 so the signed SSE2 min/max order them correctly
+                const __m128i bias = sizeof(T) == 1 ? _mm_setzero_si128() : _mm_set1_epi16(static_cast<short>(0x8000));
+                __m128i vlo = _mm_set1_epi8(static_cast<char>(0xFF)), vhi = _mm_setzero_si128();
+                if (sizeof(T) == 2) {
+                    vlo = _mm_set1_epi16(0x7FFF);
+                    vhi = _mm_set1_epi16(static_cast<short>(0x8000));
+                }
+                for (; c + lanes <= pixels.cols; c += lanes) {
+                    __m128i v = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row + c)), bias);
+                    if (sizeof(T) == 1) {
+                        vlo = _mm_min_epu8(vlo, v);
+                        vhi = _mm_max_epu8(vhi, v);
+                    }
+                    else {
+                        vlo = _mm_min_epi16(vlo, v);
+                        vhi = _mm_max_epi16(vhi, v);
+                    }
+                }
+                alignas(16) T lowLanes[lanes], highLanes[lanes];
+                _mm_store_si128(reinterpret_cast<__m128i*>(lowLanes), _mm_xor_si128(vlo, bias));
+                _mm_store_si128(reinterpret_cast<__m128i*>(highLanes), _mm_xor_si128(vhi, bias));
+                for (int k = 0; k < lanes; k++) {
+                    lo = min(lo, lowLanes[k]);
+                    hi = max(hi, highLanes[k]);
+                }
+            }
+#endif
+            for (; c < pixels.cols; c++) {
+                lo = min(lo, row[c]);
+                hi = max(hi, row[c]);
+            }
+        }
+
+        if (pixels.rows > 0 && pixels.cols > 0) {
+            minPixelValue = lo;
+            maxPixelValue = hi;
+        }
+    });
+}
+
+// SOBEL GRADIENTS
+// Gx = [1 2 1]^T x [-1 0 1] and Gy = [-1 0 1]^T x [1 2 1] are computed
+// separably: a vertical pass builds one smoothed and one differenced row, a
+// horizontal pass combines them and the magnitude goes straight to the output
+// row. Only two scratch rows are live; the one-pixel border stays 0.
+enum GradientNorm { GradientL2, GradientL1, GradientFast };
+
+// Quantized gradient direction with y pointing down:
+// 0 along x, 1 along (1,1), 2 along y, 3 along (1,-1)
+inline uint8_t gradientSector(int gx, int gy) {
+    int ax = abs(gx), ay = abs(gy);
+    // tan(22.5) ~ 106/256 and tan(67.5) ~ 618/256
+    if (ay * 256 <= ax * 106)
+        return 0;
+    if (ay * 256 >= ax * 618)
+        return 2;
+    return (gx > 0) == (gy > 0) ? 1 : 3;
+}
+
+// Alpha-max-plus-beta-min with alpha ~ 0.96 and beta ~ 0.398 (within 4% of L2)
+inline int fastGradientMagnitude(int ax, int ay) {
+    int high = max(ax, ay), low = min(ax, ay);
+    return static_cast<int>((static_cast<int64_t>(high) * 62915 >> 16) + (static_cast<int64_t>(low) * 26083 >> 16));
+}
+
+// 8-bit images take float square roots (exact for every value that survives
+// the clamp); 16-bit images need double precision.
+template <typename T>
+inline int gradientMagnitude(int gx, int gy, GradientNorm norm) {
+    if (norm == GradientL1)
+        return abs(gx) + abs(gy);
+    if (norm == GradientFast)
+        return fastGradientMagnitude(abs(gx), abs(gy));
+    if (sizeof(T) == 1)
+        return static_cast<int>(sqrtf(static_cast<float>(gx * gx + gy * gy)) + 0.5f);
+    return static_cast<int>(sqrt(static_cast<double>(gx) * gx + static_cast<double>(gy) * gy) + 0.5);
+}
+
+// 8-bit sums fit 16-bit lanes (|s| <= 1020), 16-bit sums need 32 bits
+template <typename T>
+using SobelSum = typename conditional<sizeof(T) == 1, int16_t, int32_t>::type;
+
+// Vertical half of both kernels for one row: smooth = up + 2 mid + down and
+// diff = down - up. Then Gx = s[j + 1] - s[j - 1], Gy = d[j - 1] + 2 d[j] + d[j + 1].
+template <typename T>
+inline void sobelColumnPass(const T* up, const T* mid, const T* down, int cols, SobelSum<T>* s, SobelSum<T>* d) {
+    using Acc = SobelSum<T>;
+    int j = 0;
+#ifdef __SSE2__
+    if (sizeof(T) == 1) {
+        const __m128i zero = _mm_setzero_si128();
+        for (; j + 8 <= cols; j += 8) {
+            __m128i u = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(up + j)), zero);
+            __m128i m = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(mid + j)), zero);
+            __m128i w = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(down + j)), zero);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(s + j), _mm_add_epi16(_mm_add_epi16(u, w), _mm_add_epi16(m, m)));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(d + j), _mm_sub_epi16(w, u));
+        }
+    }
+#endif
+    for (; j < cols; ++j) {
+        s[j] = static_cast<Acc>(up[j] + 2 * mid[j] + down[j]);
+        d[j] = static_cast<Acc>(down[j] - up[j]);
+    }
+}
+
+// Writes rows [rowBegin, rowEnd) of the Sobel response. With xOnly the output
+// is Gx clamped to [0, maxGray], otherwise the gradient magnitude in the given
+// norm; directions, if given, receives gradientSector for every pixel.
+template <typename T>
+void sobelGradientRows(const PixelBuffer& src, PixelBuffer& out, PixelBuffer* directions,
+    GradientNorm norm, bool xOnly, int maxGray, int rowBegin, int rowEnd) {
+    using Acc = SobelSum<T>;
+    int cols = src.cols;
+    vector<Acc> smooth(cols), diff(cols);
+
+    for (int i = max(rowBegin, 1); i < min(rowEnd, src.rows - 1); ++i) {
+        const T* up = src.row<T>(i - 1);
+        const T* mid = src.row<T>(i);
+        const T* down = src.row<T>(i + 1);
+        T* result = out.row<T>(i);
+        Acc* s = smooth.data();
+        Acc* d = diff.data();
+        sobelColumnPass<T>(up, mid, down, cols, s, d);
+
+        int j = 1;
+#ifdef __SSE2__
+        if (sizeof(T) == 1) {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i limit = _mm_set1_epi16(static_cast<short>(maxGray));
+            const __m128i half = _mm_castps_si128(_mm_set1_ps(0.5f));
+            for (; j + 9 <= cols; j += 8) {
+                __m128i gx = _mm_sub_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s + j + 1)),
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + j - 1)));
+                __m128i dc = _mm_loadu_si128(reinterpret_cast<const __m128i*>(d + j));
+                __m128i gy = _mm_add_epi16(_mm_add_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(d + j - 1)),
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(d + j + 1))), _mm_add_epi16(dc, dc));
+
+                __m128i value;
+                if (xOnly)
+                    value = gx;
+                else if (norm == GradientL2) {
+                    __m128i low = _mm_unpacklo_epi16(gx, gy), high = _mm_unpackhi_epi16(gx, gy);
+                    __m128 lowRoot = _mm_add_ps(_mm_sqrt_ps(_mm_cvtepi32_ps(_mm_madd_epi16(low, low))), _mm_castsi128_ps(half));
+                    __m128 highRoot = _mm_add_ps(_mm_sqrt_ps(_mm_cvtepi32_ps(_mm_madd_epi16(high, high))), _mm_castsi128_ps(half));
+                    value = _mm_packs_epi32(_mm_cvttps_epi32(lowRoot), _mm_cvttps_epi32(highRoot));
+                }
+                else {
+                    __m128i ax = _mm_max_epi16(gx, _mm_sub_epi16(zero, gx));
+                    __m128i ay = _mm_max_epi16(gy, _mm_sub_epi16(zero, gy));
+                    if (norm == GradientL1)
+                        value = _mm_add_epi16(ax, ay);
+                    else
+                        value = _mm_add_epi16(_mm_mulhi_epu16(_mm_max_epi16(ax, ay), _mm_set1_epi16(static_cast<short>(62915))),
+                            _mm_mulhi_epu16(_mm_min_epi16(ax, ay), _mm_set1_epi16(26083)));
+                }
+
+                value = _mm_min_epi16(_mm_max_epi16(value, zero), limit);
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(result + j), _mm_packus_epi16(value, value));
+            }
+        }
+#endif
+        for (; j < cols - 1; ++j) {
+            int gx = s[j + 1] - s[j - 1];
+            int gy = d[j - 1] + 2 * d[j] + d[j + 1];
+            result[j] = clampPixel<T>(xOnly ? gx : gradientMagnitude<T>(gx, gy, norm), maxGray);
+        }
+
+        if (directions != nullptr) {
+            uint8_t* sector = directions->row<uint8_t>(i);
+            for (j = 1; j < cols - 1; ++j)
+                sector[j] = gradientSector(s[j + 1] - s[j - 1], d[j - 1] + 2 * d[j] + d[j + 1]);
+        }
+    }
+}
+
+// BORDERS
+enum BorderMode { BorderReplicate, BorderReflect };
+
+// Maps a coordinate outside [0, n) back inside. Replicate clamps to the edge;
+// reflect mirrors around it, repeating the edge pixel (cba|abcdef|fed).
+inline int borderIndex(int i, int n, BorderMode mode) {
+    if (i >= 0 && i < n)
+        return i;
+    if (mode == BorderReplicate || n == 1)
+        return i < 0 ? 0 : n - 1;
+
+    int period = 2 * n;
+    i %= period;
+    if (i < 0)
+        i += period;
+    return i < n ? i : period - 1 - i;
+}
+
+// BOX FILTER
+// Separable running sums: the column sums slide down one row at a time (one
+// add and one subtract per column, vectorizable across the row) and every
+// output row is a difference of prefix sums over them, so the cost per pixel
+// does not depend on the window size.
+template <typename T>
+void boxFilterRows(const PixelBuffer& src, PixelBuffer& out, int radiusX, int radiusY, BorderMode border,
+    int rowBegin, int rowEnd) {
+    int rows = src.rows, cols = src.cols;
+    int paddedCols = cols + 2 * radiusX;
+    static thread_local vector<uint32_t> columnSums;
+    static thread_local vector<uint64_t> prefix;
+    static thread_local vector<int> sourceCol;
+    columnSums.assign(cols, 0);
+    prefix.assign(paddedCols + 1, 0);
+    sourceCol.resize(paddedCols);
+    for (int k = 0; k < paddedCols; k++)
+        sourceCol[k] = borderIndex(k - radiusX, cols, border);
+
+    // Window areas are odd, so the rounded mean is never a tie and the double
+    // reciprocal rounds exactly like (sum + area / 2) / area
+    double scale = 1.0 / ((2.0 * radiusX + 1) * (2.0 * radiusY + 1));
+
+    for (int y = rowBegin - radiusY; y <= rowBegin + radiusY; y++) {
+        const T* row = src.row<T>(borderIndex(y, rows, border));
+        for (int j = 0; j < cols; j++)
+            columnSums[j] += row[j];
+    }
+
+    for (int i = rowBegin; i < rowEnd; i++) {
+        if (i > rowBegin) {
+            const T* entering = src.row<T>(borderIndex(i + radiusY, rows, border));
+            const T* leaving = src.row<T>(borderIndex(i - radiusY - 1, rows, border));
+            for (int j = 0; j < cols; j++)
+                columnSums[j] += entering[j] - leaving[j];
+        }
+
+        for (int k = 0; k < paddedCols; k++)
+            prefix[k + 1] = prefix[k] + columnSums[sourceCol[k]];
+
+        T* result = out.row<T>(i);
+        const uint64_t* windowEnd = prefix.data() + 2 * radiusX + 1;
+        for (int j = 0; j < cols; j++)
+            result[j] = static_cast<T>(static_cast<double>(windowEnd[j] - prefix[j]) * scale + 0.5);
+    }
+}
+
+// GAUSSIAN BLUR
+// Deriche's recursive approximation: the Gaussian is fitted by
+// h(n) = sum_k alpha_k p_k^|n| with two pairs of complex poles, split into a
+// causal part (n >= 0) and an anticausal one (n < 0). Each is a fourth-order
+// recursion, run left to right and right to left over the same input and
+// added, so the cost per sample does not depend on sigma (within 0.05% of the
+// sampled Gaussian's peak for any sigma). Lanes signals are filtered side by
+// side (one per lane, interleaved) so the inner loops vectorize: rows in
+// groups of Lanes into a float image, then its columns in strips, straight
+// into the output. Past both ends the edge pixel repeats, which puts either
+// recursion in its steady state there, so both start exactly. The state is
+// double; with poles this close to 1, float drifts at large sigma.
+struct RecursiveGaussian {
+    static constexpr int Lanes = 16;
+    double causal[4] = {};          // y[n] = causal . x[n..n-3] - feedback . y[n-1..n-4]
+    double anticausal[4] = {};      // y[n] = anticausal . x[n+1..n+4] - feedback . y[n+1..n+4]
+    double feedback[4] = {};
+    double causalGain = 0, anticausalGain = 0;      // steady-state output for a constant 1
+
+    explicit RecursiveGaussian(double sigma) {
+        const complex<double> alpha[4] = { { 0.84, 1.8675 }, { 0.84, -1.8675 }, { -0.34015, -0.1299 }, { -0.34015, 0.1299 } };
+        const complex<double> pole[4] = { polar(exp(-1.783 / sigma), -0.6318 / sigma), polar(exp(-1.783 / sigma), 0.6318 / sigma),
+            polar(exp(-1.723 / sigma), -1.997 / sigma), polar(exp(-1.723 / sigma), 1.997 / sigma) };
+
+        // Coefficients of x^0.. in prod (1 - p_k x), and per part the sum over
+        // k of alpha_k prod_{j != k} (1 - p_j x), times p_k x for the anticausal one
+        auto multiply = [](complex<double>* poly, int degree, complex<double> root) {
+            for (int i = degree + 1; i > 0; i--)
+                poly[i] -= root * poly[i - 1];
+        };
+        complex<double> denominator[5] = { 1.0 }, forward[5] = {}, backward[5] = {};
+        for (int k = 0; k < 4; k++) {
+            multiply(denominator, k, pole[k]);
+            complex<double> others[5] = { 1.0 };
+            int degree = 0;
+            for (int j = 0; j < 4; j++)
+                if (j != k)
+                    multiply(others, degree++, pole[j]);
+            for (int i = 0; i < 4; i++) {
+                forward[i] += alpha[k] * others[i];
+                backward[i + 1] += alpha[k] * pole[k] * others[i];
+            }
+        }
+
+        // Normalized so the whole response sums to 1
+        double denominatorSum = 0, total = 0;
+        for (int i = 0; i < 5; i++) {
+            denominatorSum += denominator[i].real();
+            total += forward[i].real() + backward[i].real();
+        }
+        total /= denominatorSum;
+        causalGain = anticausalGain = 0;
+        for (int i = 0; i < 4; i++) {
+            causal[i] = forward[i].real() / total;
+            anticausal[i] = backward[i + 1].real() / total;
+            feedback[i] = denominator[i + 1].real();
+            causalGain += causal[i] / denominatorSum;
+            anticausalGain += anticausal[i] / denominatorSum;
+        }
+    }
+
+#ifdef __SSE2__
+    static __m128d loadPair(const float* p) {
+        return _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p))));
+    }
+
+    static void storePair(float* p, __m128d v) {
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(p), _mm_castps_si128(_mm_cvtpd_ps(v)));
+    }
+#endif
+
+    // Filters Lanes signals of n samples in place; sample k of lane l is
+    // line[k * Lanes + l]. scratch holds n * Lanes floats. The SSE2 path runs
+    // four lanes at a time with the state in registers, in the same order of
+    // operations as the scalar one. The previous output is subtracted last, so
+    // only one multiply and one subtract lie on the chain from sample to sample.
+    void filter(float* line, float* scratch, int n) const {
+        const size_t lastRow = static_cast<size_t>(n - 1) * Lanes;
+        int first = 0;
+#ifdef __SSE2__
+        const __m128d n0 = _mm_set1_pd(causal[0]), n1 = _mm_set1_pd(causal[1]);
+        const __m128d n2 = _mm_set1_pd(causal[2]), n3 = _mm_set1_pd(causal[3]);
+        const __m128d m1 = _mm_set1_pd(anticausal[0]), m2 = _mm_set1_pd(anticausal[1]);
+        const __m128d m3 = _mm_set1_pd(anticausal[2]), m4 = _mm_set1_pd(anticausal[3]);
+        const __m128d d1 = _mm_set1_pd(feedback[0]), d2 = _mm_set1_pd(feedback[1]);
+        const __m128d d3 = _mm_set1_pd(feedback[2]), d4 = _mm_set1_pd(feedback[3]);
+        for (; first + 4 <= Lanes; first += 4) {
+            __m128d x1[2], x2[2], x3[2], x4[2], y1[2], y2[2], y3[2], y4[2];
+            for (int h = 0; h < 2; h++) {
+                x1[h] = x2[h] = x3[h] = loadPair(line + first + 2 * h);
+                y1[h] = y2[h] = y3[h] = y4[h] = _mm_mul_pd(x1[h], _mm_set1_pd(causalGain));
+            }
+            for (int k = 0; k < n; k++) {
+                const float* x = line + static_cast<size_t>(k) * Lanes + first;
+                float* out = scratch + static_cast<size_t>(k) * Lanes + first;
+                for (int h = 0; h < 2; h++) {
+                    __m128d in = loadPair(x + 2 * h);
+                    __m128d y = _mm_add_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(n0, in), _mm_mul_pd(n1, x1[h])),
+                        _mm_mul_pd(n2, x2[h])), _mm_mul_pd(n3, x3[h]));
+                    y = _mm_sub_pd(_mm_sub_pd(_mm_sub_pd(_mm_sub_pd(y, _mm_mul_pd(d4, y4[h])), _mm_mul_pd(d3, y3[h])),
+                        _mm_mul_pd(d2, y2[h])), _mm_mul_pd(d1, y1[h]));
+                    x3[h] = x2[h];
+                    x2[h] = x1[h];
+                    x1[h] = in;
+                    y4[h] = y3[h];
+                    y3[h] = y2[h];
+                    y2[h] = y1[h];
+                    y1[h] = y;
+                    storePair(out + 2 * h, y);
+                }
+            }
+
+            for (int h = 0; h < 2; h++) {
+                x1[h] = x2[h] = x3[h] = x4[h] = loadPair(line + lastRow + first + 2 * h);
+                y1[h] = y2[h] = y3[h] = y4[h] = _mm_mul_pd(x1[h], _mm_set1_pd(anticausalGain));
+            }
+            for (int k = n - 1; k >= 0; k--) {
+                float* x = line + static_cast<size_t>(k) * Lanes + first;
+                const float* forward = scratch + static_cast<size_t>(k) * Lanes + first;
+                for (int h = 0; h < 2; h++) {
+                    __m128d y = _mm_add_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(m1, x1[h]), _mm_mul_pd(m2, x2[h])),
+                        _mm_mul_pd(m3, x3[h])), _mm_mul_pd(m4, x4[h]));
+                    y = _mm_sub_pd(_mm_sub_pd(_mm_sub_pd(_mm_sub_pd(y, _mm_mul_pd(d4, y4[h])), _mm_mul_pd(d3, y3[h])),
+                        _mm_mul_pd(d2, y2[h])), _mm_mul_pd(d1, y1[h]));
+                    x4[h] = x3[h];
+                    x3[h] = x2[h];
+                    x2[h] = x1[h];
+                    x1[h] = loadPair(x + 2 * h);
+                    y4[h] = y3[h];
+                    y3[h] = y2[h];
+                    y2[h] = y1[h];
+                    y1[h] = y;
+                    storePair(x + 2 * h, _mm_add_pd(loadPair(forward + 2 * h), y));
+                }
+            }
+        }
+#endif
+        for (; first < Lanes; first++) {
+            double x1, x2, x3, x4, y1, y2, y3, y4;
+            x1 = x2 = x3 = line[first];
+            y1 = y2 = y3 = y4 = line[first] * causalGain;
+            for (int k = 0; k < n; k++) {
+                float in = line[static_cast<size_t>(k) * Lanes + first];
+                double y = causal[0] * in + causal[1] * x1 + causal[2] * x2 + causal[3] * x3
+                    - feedback[3] * y4 - feedback[2] * y3 - feedback[1] * y2 - feedback[0] * y1;
+                x3 = x2;
+                x2 = x1;
+                x1 = in;
+                y4 = y3;
+                y3 = y2;
+                y2 = y1;
+                y1 = y;
+                scratch[static_cast<size_t>(k) * Lanes + first] = static_cast<float>(y);
+            }
+
+            x1 = x2 = x3 = x4 = line[lastRow + first];
+            y1 = y2 = y3 = y4 = line[lastRow + first] * anticausalGain;
+            for (int k = n - 1; k >= 0; k--) {
+                float& x = line[static_cast<size_t>(k) * Lanes + first];
+                double y = anticausal[0] * x1 + anticausal[1] * x2 + anticausal[2] * x3 + anticausal[3] * x4
+                    - feedback[3] * y4 - feedback[2] * y3 - feedback[1] * y2 - feedback[0] * y1;
+                x4 = x3;
+                x3 = x2;
+                x2 = x1;
+                x1 = x;
+                y4 = y3;
+                y3 = y2;
+                y2 = y1;
+                y1 = y;
+                x = static_cast<float>(scratch[static_cast<size_t>(k) * Lanes + first] + y);
+            }
+        }
+    }
+};
+
+// Rows [rowBegin, rowEnd) of src filtered along x into the float image out
+template <typename T>
+void gaussianRowPass(const PixelBuffer& src, PixelBuffer& out, const RecursiveGaussian& gaussian, int rowBegin, int rowEnd) {
+    const int lanes = RecursiveGaussian::Lanes;
+    int cols = src.cols;
+    static thread_local vector<float> line, scratch;
+    line.resize(static_cast<size_t>(cols) * lanes);
+    scratch.resize(line.size());
+
+    for (int first = rowBegin; first < rowEnd; first += lanes) {
+        int count = min(lanes, rowEnd - first);
+        // Spare lanes repeat the last row
+        for (int l = 0; l < lanes; l++) {
+            const T* in = src.row<T>(first + min(l, count - 1));
+            for (int j = 0; j < cols; j++)
+                line[static_cast<size_t>(j) * lanes + l] = in[j];
+        }
+        gaussian.filter(line.data(), scratch.data(), cols);
+        for (int l = 0; l < count; l++) {
+            float* result = out.row<float>(first + l);
+            for (int j = 0; j < cols; j++)
+                result[j] = line[static_cast<size_t>(j) * lanes + l];
+        }
+    }
+}
+
+// Columns [colBegin, colEnd) of the row pass filtered along y and rounded
+template <typename T>
+void gaussianColumnPass(const PixelBuffer& src, PixelBuffer& out, const RecursiveGaussian& gaussian, int maxGray,
+    int colBegin, int colEnd) {
+    const int lanes = RecursiveGaussian::Lanes;
+    int rows = src.rows;
+    static thread_local vector<float> line, scratch;
+    line.resize(static_cast<size_t>(rows) * lanes);
+    scratch.resize(line.size());
+
+    for (int first = colBegin; first < colEnd; first += lanes) {
+        int count = min(lanes, colEnd - first);
+        for (int k = 0; k < rows; k++) {
+            const float* in = src.row<float>(k) + first;
+            float* x = line.data() + static_cast<size_t>(k) * lanes;
+            if (count == lanes)
+                memcpy(x, in, lanes * sizeof(float));
+            else
+                for (int l = 0; l < lanes; l++)
+                    x[l] = in[min(l, count - 1)];
+        }
+        gaussian.filter(line.data(), scratch.data(), rows);
+        for (int k = 0; k < rows; k++) {
+            const float* x = line.data() + static_cast<size_t>(k) * lanes;
+            T* result = out.row<T>(k) + first;
+            for (int l = 0; l < count; l++)
+                result[l] = clampPixel<T>(static_cast<int>(x[l] + 0.5f), maxGray);
+        }
+    }
+}
+
+// MEDIAN FILTER
+// Radius 1 and 2 (3x3 and 5x5) run a branchless min/max sorting network on a
+// whole SSE2 register of pixels at a time. Larger radii use the constant-time
+// histogram algorithm below. Borders replicate the edge pixels.
+
+// Paeth's 19-exchange median of 9; the median ends in slot 4
+const uint8_t medianNetwork9[][2] = {
+    { 1, 2 }, { 4, 5 }, { 7, 8 }, { 0, 1 }, { 3, 4 }, { 6, 7 }, { 1, 2 }, { 4, 5 },
+    { 7, 8 }, { 0, 3 }, { 5, 8 }, { 4, 7 }, { 3, 6 }, { 1, 4 }, { 2, 5 }, { 4, 7 },
+    { 4, 2 }, { 6, 4 }, { 4, 2 }
+};
+
+// Batcher's odd-even merge sort on 32 wires, with the exchanges that only move
+// padding or cannot reach the middle output pruned; the median ends in slot 12
+const uint8_t medianNetwork25[][2] = {
+    { 0, 1 }, { 2, 3 }, { 4, 5 }, { 6, 7 }, { 8, 9 }, { 10, 11 }, { 12, 13 }, { 14, 15 },
+    { 16, 17 }, { 18, 19 }, { 20, 21 }, { 22, 23 }, { 0, 2 }, { 1, 3 }, { 4, 6 }, { 5, 7 },
+    { 8, 10 }, { 9, 11 }, { 12, 14 }, { 13, 15 }, { 16, 18 }, { 17, 19 }, { 20, 22 }, { 21, 23 },
+    { 1, 2 }, { 5, 6 }, { 9, 10 }, { 13, 14 }, { 17, 18 }, { 21, 22 }, { 0, 4 }, { 1, 5 },
+    { 2, 6 }, { 3, 7 }, { 8, 12 }, { 9, 13 }, { 10, 14 }, { 11, 15 }, { 16, 20 }, { 17, 21 },
+    { 18, 22 }, { 19, 23 }, { 2, 4 }, { 3, 5 }, { 10, 12 }, { 11, 13 }, { 18, 20 }, { 19, 21 },
+    { 1, 2 }, { 3, 4 }, { 5, 6 }, { 9, 10 }, { 11, 12 }, { 13, 14 }, { 17, 18 }, { 19, 20 },
+    { 21, 22 }, { 0, 8 }, { 1, 9 }, { 2, 10 }, { 3, 11 }, { 4, 12 }, { 5, 13 }, { 6, 14 },
+    { 7, 15 }, { 16, 24 }, { 4, 8 }, { 5, 9 }, { 6, 10 }, { 7, 11 }, { 20, 24 }, { 2, 4 },
+    { 3, 5 }, { 6, 8 }, { 7, 9 }, { 10, 12 }, { 11, 13 }, { 18, 20 }, { 19, 21 }, { 22, 24 },
+    { 1, 2 }, { 3, 4 }, { 5, 6 }, { 7, 8 }, { 9, 10 }, { 11, 12 }, { 13, 14 }, { 17, 18 },
+    { 19, 20 }, { 21, 22 }, { 23, 24 }, { 0, 16 }, { 1, 17 }, { 2, 18 }, { 3, 19 }, { 4, 20 },
+    { 5, 21 }, { 6, 22 }, { 7, 23 }, { 8, 24 }, { 8, 16 }, { 9, 17 }, { 10, 18 }, { 11, 19 },
+    { 12, 20 }, { 13, 21 }, { 6, 10 }, { 7, 11 }, { 12, 16 }, { 13, 17 }, { 10, 12 }, { 11, 13 },
+    { 11, 12 }
+};
+
+inline uint8_t laneMin(uint8_t a, uint8_t b) { return min(a, b); }
+inline uint8_t laneMax(uint8_t a, uint8_t b) { return max(a, b); }
+inline uint16_t laneMin(uint16_t a, uint16_t b) { return min(a, b); }
+inline uint16_t laneMax(uint16_t a, uint16_t b) { return max(a, b); }
+
+#ifdef __SSE2__
+// 16 pixels of an 8-bit image, or 8 pixels of a 16-bit image biased by 0x8000
+// so that the signed SSE2 word min/max order them correctly
+struct ByteLanes { __m128i v; };
+struct WordLanes { __m128i v; };
+inline ByteLanes laneMin(ByteLanes a, ByteLanes b) { return { _mm_min_epu8(a.v, b.v) }; }
+inline ByteLanes laneMax(ByteLanes a, ByteLanes b) { return { _mm_max_epu8(a.v, b.v) }; }
+inline WordLanes laneMin(WordLanes a, WordLanes b) { return { _mm_min_epi16(a.v, b.v) }; }
+inline WordLanes laneMax(WordLanes a, WordLanes b) { return { _mm_max_epi16(a.v, b.v) }; }
+#endif
+
+template <typename V>
+inline V runMedianNetwork(V* values, int radius) {
+    const uint8_t (*network)[2] = radius == 1 ? medianNetwork9 : medianNetwork25;
+    int exchanges = radius == 1 ? sizeof(medianNetwork9) / 2 : sizeof(medianNetwork25) / 2;
+    for (int k = 0; k < exchanges; k++) {
+        V a = values[network[k][0]], b = values[network[k][1]];
+        values[network[k][0]] = laneMin(a, b);
+        values[network[k][1]] = laneMax(a, b);
+    }
+    return values[radius == 1 ? 4 : 12];
+}
+
+template <typename T>
+void medianNetworkRows(const PixelBuffer& src, PixelBuffer& out, int radius, int rowBegin, int rowEnd) {
+    int rows = src.rows, cols = src.cols;
+    int side = 2 * radius + 1;
+    const T* window[5];
+
+    for (int i = rowBegin; i < rowEnd; i++) {
+        for (int k = 0; k < side; k++)
+            window[k] = src.row<T>(min(max(i + k - radius, 0), rows - 1));
+        T* result = out.row<T>(i);
+
+        auto medianAt = [&](int j) {
+            T values[25];
+            int n = 0;
+            for (int k = 0; k < side; k++)
+                for (int dj = -radius; dj <= radius; dj++)
+                    values[n++] = window[k][min(max(j + dj, 0), cols - 1)];
+            result[j] = runMedianNetwork(values, radius);
+        };
+
+        int j = 0;
+        for (; j < min(radius, cols); j++)
+            medianAt(j);
+
+#ifdef __SSE2__
+        const int lanes = 16 / sizeof(T);
+        for (; j + lanes + radius <= cols; j += lanes) {
+            if (sizeof(T) == 1) {
+                ByteLanes values[25];
+                int n = 0;
+                for (int k = 0; k < side; k++)
+                    for (int dj = -radius; dj <= radius; dj++)
+                        values[n++].v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(window[k] + j + dj));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(result + j), runMedianNetwork(values, radius).v);
+            }
+            else {
+                const __m128i bias = _mm_set1_epi16(static_cast<short>(0x8000));
+                WordLanes values[25];
+                int n = 0;
+                for (int k = 0; k < side; k++)
+                    for (int dj = -radius; dj <= radius; dj++)
+                        values[n++].v = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(window[k] + j + dj)), bias);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(result + j), _mm_xor_si128(runMedianNetwork(values, radius).v, bias));
+            }
+        }
+#endif
+        for (; j < cols; j++)
+            medianAt(j);
+    }
+}
+
+// kernel[b] += plus[b] - minus[b] for bins [0, n), n a multiple of 8; minus may be null
+inline void slideHistogram(uint16_t* kernel, const uint16_t* plus, const uint16_t* minus, int n) {
+    int b = 0;
+#ifdef __SSE2__
+    for (; b + 8 <= n; b += 8) {
+        __m128i sum = _mm_add_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(kernel + b)),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(plus + b)));
+        if (minus != nullptr)
+            sum = _mm_sub_epi16(sum, _mm_loadu_si128(reinterpret_cast<const __m128i*>(minus + b)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(kernel + b), sum);
+    }
+#endif
+    for (; b < n; b++)
+        kernel[b] += plus[b] - (minus != nullptr ? minus[b] : 0);
+}
+
+// Fine level of the 8-bit median histograms: a full 256-bin histogram per column
+struct DenseFineColumns {
+    static constexpr int Shift = 4;
+    static constexpr int Bins = 256;
+    vector<uint16_t> counts;
+
+    void reset(int columns, int) {
+        counts.assign(static_cast<size_t>(columns) * Bins, 0);
+    }
+
+    void insert(int h, int value) {
+        counts[static_cast<size_t>(h) * Bins + value]++;
+    }
+
+    void replace(int h, int oldValue, int newValue) {
+        counts[static_cast<size_t>(h) * Bins + oldValue]--;
+        counts[static_cast<size_t>(h) * Bins + newValue]++;
+    }
+
+    // Adds the counts of column h for the values of coarse bin to kernel
+    void add(int h, int bin, uint16_t* kernel) const {
+        slideHistogram(kernel, &counts[static_cast<size_t>(h) * Bins + (bin << Shift)], nullptr, 1 << Shift);
+    }
+
+    // The same for column entering, less the counts of column leaving
+    void slide(int entering, int leaving, int bin, uint16_t* kernel) const {
+        slideHistogram(kernel, &counts[static_cast<size_t>(entering) * Bins + (bin << Shift)],
+            &counts[static_cast<size_t>(leaving) * Bins + (bin << Shift)], 1 << Shift);
+    }
+};
+
+// Fine level of the 16-bit median histograms. A dense 65536-bin histogram per
+// column would cost 128 KB each, so instead every column keeps its 2r+1
+// samples sorted, with the index where each coarse bin's run of samples
+// starts. Accumulating a bin then walks just that run, and a column costs
+// about 2 bytes per sample plus 257 bytes whatever the radius.
+struct SortedFineColumns {
+    static constexpr int Shift = 8;
+    static constexpr int Bins = 256;
+    vector<uint16_t> samples;
+    vector<uint8_t> starts;     // Bins + 1 per column; fits as 2r+1 <= 255
+    int window = 0;
+
+    // First of count sorted samples that is not below value; branch free, as
+    // the comparisons are unpredictable
+    static uint16_t* lowerBound(uint16_t* first, int count, int value) {
+        if (count == 0)
+            return first;
+        while (count > 1) {
+            int half = count / 2;
+            first = first[half] < value ? first + half : first;
+            count -= half;
+        }
+        return first + (*first < value);
+    }
+
+    // Adds delta to the run starts of bins [first, last]
+    static void shiftStarts(uint8_t* start, int first, int last, int delta) {
+        int b = first;
+#ifdef __SSE2__
+        __m128i step = _mm_set1_epi8(static_cast<char>(delta));
+        for (; b + 16 <= last + 1; b += 16) {
+            __m128i* block = reinterpret_cast<__m128i*>(start + b);
+            _mm_storeu_si128(block, _mm_add_epi8(_mm_loadu_si128(block), step));
+        }
+#endif
+        for (; b <= last; b++)
+            start[b] += delta;
+    }
+
+    void reset(int columns, int newWindow) {
+        window = newWindow;
+        samples.assign(static_cast<size_t>(columns) * window, 0);
+        starts.assign(static_cast<size_t>(columns) * (Bins + 1), 0);
+    }
+
+    void insert(int h, int value) {
+        uint16_t* column = &samples[static_cast<size_t>(h) * window];
+        uint8_t* start = &starts[static_cast<size_t>(h) * (Bins + 1)];
+        int bin = value >> Shift;
+        uint16_t* end = column + start[Bins];
+        uint16_t* at = lowerBound(column + start[bin], start[bin + 1] - start[bin], value + 1);
+        memmove(at + 1, at, (end - at) * sizeof(uint16_t));
+        *at = static_cast<uint16_t>(value);
+        shiftStarts(start, bin + 1, Bins, 1);
+    }
+
+    // Removes oldValue and inserts newValue, shifting only the samples and
+    // run starts between them
+    void replace(int h, int oldValue, int newValue) {
+        uint16_t* column = &samples[static_cast<size_t>(h) * window];
+        uint8_t* start = &starts[static_cast<size_t>(h) * (Bins + 1)];
+        int oldBin = oldValue >> Shift, newBin = newValue >> Shift;
+        uint16_t* from = lowerBound(column + start[oldBin], start[oldBin + 1] - start[oldBin], oldValue);
+        if (newValue > oldValue) {
+            uint16_t* to = lowerBound(column + start[newBin], start[newBin + 1] - start[newBin], newValue) - 1;
+            memmove(from, from + 1, (to - from) * sizeof(uint16_t));
+            *to = static_cast<uint16_t>(newValue);
+            shiftStarts(start, oldBin + 1, newBin, -1);
+        }
+        else if (newValue < oldValue) {
+            uint16_t* to = lowerBound(column + start[newBin], start[newBin + 1] - start[newBin], newValue + 1);
+            memmove(to + 1, to, (from - to) * sizeof(uint16_t));
+            *to = static_cast<uint16_t>(newValue);
+            shiftStarts(start, newBin + 1, oldBin, 1);
+        }
+    }
+
+    // Adds sign times the counts of column h for the values of coarse bin to
+    // kernel, one run of equal samples at a time
+    void accumulate(int h, int bin, uint16_t* kernel, int sign) const {
+        const uint16_t* column = &samples[static_cast<size_t>(h) * window];
+        const uint8_t* start = &starts[static_cast<size_t>(h) * (Bins + 1)];
+        const uint16_t* p = column + start[bin];
+        const uint16_t* end = column + start[bin + 1];
+        while (p != end) {
+            const uint16_t* run = p + 1;
+            while (run != end && *run == *p)
+                run++;
+            kernel[*p & (Bins - 1)] += sign * static_cast<int>(run - p);
+            p = run;
+        }
+    }
+
+    void add(int h, int bin, uint16_t* kernel) const {
+        accumulate(h, bin, kernel, 1);
+    }
+
+    void slide(int entering, int leaving, int bin, uint16_t* kernel) const {
+        accumulate(entering, bin, kernel, 1);
+        accumulate(leaving, bin, kernel, -1);
+    }
+};
+
+template <typename T>
+using MedianFineColumns = typename conditional<sizeof(T) == 1, DenseFineColumns, SortedFineColumns>::type;
+
+// Perreault & Hebert, "Median Filtering in Constant Time" (2007). Every column
+// keeps a histogram of its 2r+1 pixels, updated with one removal and one
+// insertion per row, and the kernel histogram slides along the row by adding
+// one column histogram and removing another. Histograms are two-level: coarse
+// bins over the high half of the bits, fine bins over the full value (see
+// MedianFineColumns). Fine kernel bins are only brought up to date for the
+// coarse bin that holds the median. Columns take at most about 1.3 KB, so a
+// strip covers the whole row of any image up to several thousand pixels wide
+// and the per-row setup is spread over all of it.
+template <typename T>
+void medianHistogramRows(const PixelBuffer& src, PixelBuffer& out, int radius, int rowBegin, int rowEnd) {
+    const int coarseShift = 4 * sizeof(T);
+    const int coarseBins = 1 << coarseShift;
+    const int fineBins = 1 << (8 * sizeof(T));
+    const size_t histogramBudget = static_cast<size_t>(8) << 20;
+
+    int rows = src.rows, cols = src.cols;
+    int side = 2 * radius + 1;
+    int target = side * side / 2;
+    size_t columnBytes = coarseBins * sizeof(uint16_t)
+        + (sizeof(T) == 1 ? DenseFineColumns::Bins * sizeof(uint16_t) : side * sizeof(uint16_t) + SortedFineColumns::Bins + 1);
+    int stripWidth = max(16, static_cast<int>(histogramBudget / columnBytes) - 2 * radius);
+
+    static thread_local vector<uint16_t> coarse, kernelCoarse, kernelFine;
+    static thread_local MedianFineColumns<T> fine;
+    static thread_local vector<int> fineValidAt, sourceCol;
+    kernelCoarse.assign(coarseBins, 0);
+    kernelFine.assign(fineBins, 0);
+    fineValidAt.assign(coarseBins, 0);
+
+    for (int c0 = 0; c0 < cols; c0 += stripWidth) {
+        int c1 = min(c0 + stripWidth, cols);
+        int histCols = c1 - c0 + 2 * radius;
+
+        // Histogram column h covers image column c0 - radius + h, clamped
+        sourceCol.resize(histCols);
+        for (int h = 0; h < histCols; h++)
+            sourceCol[h] = min(max(c0 - radius + h, 0), cols - 1);
+
+        coarse.assign(static_cast<size_t>(histCols) * coarseBins, 0);
+        fine.reset(histCols, side);
+
+        for (int y = rowBegin - radius; y <= rowBegin + radius; y++) {
+            const T* row = src.row<T>(min(max(y, 0), rows - 1));
+            for (int h = 0; h < histCols; h++) {
+                T value = row[sourceCol[h]];
+                coarse[static_cast<size_t>(h) * coarseBins + (value >> coarseShift)]++;
+                fine.insert(h, value);
+            }
+        }
+
+        for (int i = rowBegin; i < rowEnd; i++) {
+            if (i > rowBegin) {
+                const T* leavingRow = src.row<T>(max(i - radius - 1, 0));
+                const T* enteringRow = src.row<T>(min(i + radius, rows - 1));
+                for (int h = 0; h < histCols; h++) {
+                    T leaving = leavingRow[sourceCol[h]], entering = enteringRow[sourceCol[h]];
+                    if (leaving == entering)
+                        continue;
+                    coarse[static_cast<size_t>(h) * coarseBins + (leaving >> coarseShift)]--;
+                    coarse[static_cast<size_t>(h) * coarseBins + (entering >> coarseShift)]++;
+                    fine.replace(h, leaving, entering);
+                }
+            }
+
+            fill(kernelCoarse.begin(), kernelCoarse.end(), 0);
+            for (int h = 0; h < side; h++)
+                slideHistogram(kernelCoarse.data(), &coarse[static_cast<size_t>(h) * coarseBins], nullptr, coarseBins);
+            fill(fineValidAt.begin(), fineValidAt.end(), -side - 1);
+
+            T* result = out.row<T>(i);
+            for (int j = c0; j < c1; j++) {
+                // Kernel at output column j spans histogram columns [h, h + 2r].
+                // Catching a fine kernel up costs two columns a step, so past
+                // half a window it is cheaper to rebuild it.
+                int h = j - c0;
+                if (h > 0)
+                    slideHistogram(kernelCoarse.data(), &coarse[static_cast<size_t>(h + 2 * radius) * coarseBins],
+                        &coarse[static_cast<size_t>(h - 1) * coarseBins], coarseBins);
+
+                int below = 0, bin = 0;
+                while (below + kernelCoarse[bin] <= target)
+                    below += kernelCoarse[bin++];
+
+                uint16_t* kernel = &kernelFine[static_cast<size_t>(bin) * coarseBins];
+                if (2 * (h - fineValidAt[bin]) > side) {
+                    fill(kernel, kernel + coarseBins, 0);
+                    for (int k = h; k < h + side; k++)
+                        fine.add(k, bin, kernel);
+                }
+                else {
+                    for (int k = fineValidAt[bin] + 1; k <= h; k++)
+                        fine.slide(k + 2 * radius, k - 1, bin, kernel);
+                }
+                fineValidAt[bin] = h;
+
+                int value = 0;
+                while (below + kernel[value] <= target)
+                    below += kernel[value++];
+                result[j] = static_cast<T>((bin << coarseShift) + value);
+            }
+        }
+    }
+}
+
+// CONVOLUTION
+// Filter files hold "N [DIVISOR]" followed by N * N taps (integers or decimals),
+// N odd. Taps are applied as a correlation, centred on the output pixel, with
+// replicated borders. Rank analysis of the kernel picks the cheapest of three
+// exact strategies: direct N x N taps, a sum of separable column/row passes
+// (one pass pair for rank 1 kernels such as Gaussians), or FFT overlap-save for
+// large dense kernels. All arithmetic is float and results round to nearest.
+enum ConvolutionStrategy { ConvolutionAuto, ConvolutionDirect, ConvolutionSeparable, ConvolutionFFT };
+
+// Iterative radix-2 FFT over interleaved (re, im) floats. The inverse uses the
+// conjugate twiddles and is not scaled.
+struct FFTPlan {
+    int size = 0;
+    vector<int> bitReversed;
+    vector<float> cosTable, sinTable;
+
+    void init(int n) {
+        size = n;
+        bitReversed.assign(n, 0);
+        for (int i = 1, j = 0; i < n; i++) {
+            int bit = n >> 1;
+            for (; j & bit; bit >>= 1)
+                j ^= bit;
+            j |= bit;
+            bitReversed[i] = j;
+        }
+
+        cosTable.resize(n / 2);
+        sinTable.resize(n / 2);
+        for (int k = 0; k < n / 2; k++) {
+            double angle = 2.0 * acos(-1.0) * k / n;
+            cosTable[k] = static_cast<float>(cos(angle));
+            sinTable[k] = static_cast<float>(sin(angle));
+        }
+    }
+
+    void transform(float* data, bool inverse) const {
+        for (int i = 0; i < size; i++) {
+            int j = bitReversed[i];
+            if (i < j) {
+                swap(data[2 * i], data[2 * j]);
+                swap(data[2 * i + 1], data[2 * j + 1]);
+            }
+        }
+
+        float direction = inverse ? 1.0f : -1.0f;
+        for (int half = 1, step = size / 2; half < size; half *= 2, step /= 2) {
+            for (int start = 0; start < size; start += 2 * half) {
+                float* a = data + 2 * start;
+                float* b = a + 2 * half;
+                for (int k = 0; k < half; k++) {
+                    float wr = cosTable[k * step], wi = direction * sinTable[k * step];
+                    float xr = b[2 * k] * wr - b[2 * k + 1] * wi;
+                    float xi = b[2 * k] * wi + b[2 * k + 1] * wr;
+                    b[2 * k] = a[2 * k] - xr;
+                    b[2 * k + 1] = a[2 * k + 1] - xi;
+                    a[2 * k] += xr;
+                    a[2 * k + 1] += xi;
+                }
+            }
+        }
+    }
+
+    // Square 2-D transform: rows, transpose, rows. The spectrum comes out
+    // transposed, which is harmless as long as both operands share the layout,
+    // and the inverse (rows, transpose, rows) undoes it.
+    void transform2D(float* data, bool inverse) const {
+        for (int r = 0; r < size; r++)
+            transform(data + 2 * static_cast<size_t>(r) * size, inverse);
+        transposeSquare(data);
+        for (int r = 0; r < size; r++)
+            transform(data + 2 * static_cast<size_t>(r) * size, inverse);
+    }
+
+    void transposeSquare(float* data) const {
+        const int block = 16;
+        for (int r0 = 0; r0 < size; r0 += block)
+            for (int c0 = r0; c0 < size; c0 += block)
+                for (int r = r0; r < min(r0 + block, size); r++)
+                    for (int c = max(c0, r + 1); c < min(c0 + block, size); c++) {
+                        float* x = data + 2 * (static_cast<size_t>(r) * size + c);
+                        float* y = data + 2 * (static_cast<size_t>(c) * size + r);
+                        swap(x[0], y[0]);
+                        swap(x[1], y[1]);
+                    }
+    }
+};
+
+// Real kernel with its decomposition and the chosen strategy
+struct ConvolutionKernel {
+    int size = 0, radius = 0;
+    vector<float> taps;                          // row-major, already divided by the divisor
+    vector<vector<float>> columnFactors, rowFactors;
+    ConvolutionStrategy strategy = ConvolutionDirect;
+    int rank = 0;
+    FFTPlan fft;
+    int fftBlock = 0;                            // outputs per tile side
+    vector<float> spectrum;                      // transposed, interleaved
+
+    // Returns 0 on success, -1 when the file cannot be opened, -2 when it is malformed
+    int load(const char* fileName) {
+        ifstream file(fileName);
+        if (!file.is_open())
+            return -1;
+
+        // The divisor is only recognised when it is alone beside N on the first
+        // line; older files that start the taps on that line still read as before
+        string firstLine;
+        getline(file, firstLine);
+        istringstream header(firstLine);
+        vector<double> headerValues;
+        double value;
+        while (header >> value)
+            headerValues.push_back(value);
+        if (headerValues.empty() || !header.eof())
+            return -2;
+
+        double sizeValue = headerValues[0];
+        if (sizeValue != floor(sizeValue) || sizeValue < 1 || sizeValue > 1023 || static_cast<int>(sizeValue) % 2 == 0)
+            return -2;
+        size = static_cast<int>(sizeValue);
+        radius = size / 2;
+
+        double divisor = 1.0;
+        size_t next = 1;
+        if (headerValues.size() == 2) {
+            divisor = headerValues[1];
+            next = 2;
+        }
+        if (divisor == 0.0 || !isfinite(divisor))
+            return -2;
+
+        size_t count = static_cast<size_t>(size) * size;
+        vector<double> values(headerValues.begin() + next, headerValues.end());
+        while (values.size() < count && file >> value)
+            values.push_back(value);
+        if (values.size() != count)
+            return -2;
+
+        taps.resize(count);
+        for (size_t k = 0; k < count; k++) {
+            if (!isfinite(values[k]))
+                return -2;
+            taps[k] = static_cast<float>(values[k] / divisor);
+        }
+        return 0;
+    }
+
+    // One-sided Jacobi SVD. Singular values below a relative 1e-6 are treated as
+    // zero, so an exactly separable kernel has rank 1 despite rounding.
+    void decompose() {
+        int n = size;
+        vector<double> u(taps.begin(), taps.end()), v(static_cast<size_t>(n) * n, 0.0);
+        for (int k = 0; k < n; k++)
+            v[static_cast<size_t>(k) * n + k] = 1.0;
+
+        for (int sweep = 0; sweep < 60; sweep++) {
+            bool rotated = false;
+            for (int p = 0; p < n - 1; p++)
+                for (int q = p + 1; q < n; q++) {
+                    double alpha = 0, beta = 0, gamma = 0;
+                    for (int i = 0; i < n; i++) {
+                        double up = u[static_cast<size_t>(i) * n + p], uq = u[static_cast<size_t>(i) * n + q];
+                        alpha += up * up;
+                        beta += uq * uq;
+                        gamma += up * uq;
+                    }
+                    if (gamma == 0.0 || fabs(gamma) <= 1e-15 * sqrt(alpha * beta))
+                        continue;
+                    rotated = true;
+
+                    double zeta = (beta - alpha) / (2.0 * gamma);
+                    double t = (zeta >= 0 ? 1.0 : -1.0) / (fabs(zeta) + sqrt(1.0 + zeta * zeta));
+                    double c = 1.0 / sqrt(1.0 + t * t), s = c * t;
+                    for (int i = 0; i < n; i++) {
+                        double* up = &u[static_cast<size_t>(i) * n + p];
+                        double* uq = &u[static_cast<size_t>(i) * n + q];
+                        double a = *up, b = *uq;
+                        *up = c * a - s * b;
+                        *uq = s * a + c * b;
+                        double* vp = &v[static_cast<size_t>(i) * n + p];
+                        double* vq = &v[static_cast<size_t>(i) * n + q];
+                        a = *vp;
+                        b = *vq;
+                        *vp = c * a - s * b;
+                        *vq = s * a + c * b;
+                    }
+                }
+            if (!rotated)
+                break;
+        }
+
+        // Column norms of u are the singular values; keep the significant ones,
+        // largest first. taps = sum over k of (u_k) (v_k)^T.
+        vector<pair<double, int>> singular(n);
+        for (int k = 0; k < n; k++) {
+            double norm = 0;
+            for (int i = 0; i < n; i++)
+                norm += u[static_cast<size_t>(i) * n + k] * u[static_cast<size_t>(i) * n + k];
+            singular[k] = { sqrt(norm), k };
+        }
+        sort(singular.begin(), singular.end(), [](const pair<double, int>& a, const pair<double, int>& b) {
+            return a.first > b.first;
+        });
+
+        columnFactors.clear();
+        rowFactors.clear();
+        for (int k = 0; k < n && singular[0].first > 0 && singular[k].first > 1e-6 * singular[0].first; k++) {
+            int index = singular[k].second;
+            vector<float> column(n), row(n);
+            for (int i = 0; i < n; i++) {
+                column[i] = static_cast<float>(u[static_cast<size_t>(i) * n + index]);
+                row[i] = static_cast<float>(v[static_cast<size_t>(i) * n + index]);
+            }
+            columnFactors.push_back(move(column));
+            rowFactors.push_back(move(row));
+        }
+        rank = static_cast<int>(columnFactors.size());
+    }
+
+    // Picks the strategy with the lowest estimated multiply-adds per pixel and
+    // prepares it. The FFT estimate counts one complex 2-D transform per tile
+    // (two real tiles share each forward and inverse transform); its 1.6 weight
+    // is the measured overhead of the scalar butterflies against the
+    // vectorized direct loops, which puts the crossover near 9 x 9.
+    void plan(ConvolutionStrategy requested = ConvolutionAuto) {
+        decompose();
+
+        int bestTile = 0;
+        double fftCost = 1e300;
+        for (int tile = 16; tile <= 1024; tile *= 2) {
+            int block = tile - size + 1;
+            if (block < tile / 4)
+                continue;
+            double log2Tile = log2(static_cast<double>(tile));
+            double cost = (5.0 * log2Tile + 2.0) * tile * tile / (static_cast<double>(block) * block);
+            if (cost < fftCost) {
+                fftCost = cost;
+                bestTile = tile;
+            }
+        }
+
+        double directCost = static_cast<double>(size) * size;
+        double separableCost = max(rank, 1) * (2.0 * size + 1);
+
+        strategy = requested;
+        if (strategy == ConvolutionAuto) {
+            strategy = ConvolutionDirect;
+            if (separableCost < directCost)
+                strategy = ConvolutionSeparable;
+            if (bestTile != 0 && 1.6 * fftCost < min(directCost, separableCost))
+                strategy = ConvolutionFFT;
+        }
+        if (strategy == ConvolutionFFT && bestTile == 0)
+            strategy = ConvolutionDirect;
+        if (strategy == ConvolutionSeparable && rank == 0) {
+            columnFactors.assign(1, vector<float>(size, 0.0f));
+            rowFactors.assign(1, vector<float>(size, 0.0f));
+        }
+
+        if (strategy == ConvolutionFFT)
+            prepareSpectrum(bestTile);
+    }
+
+    // Flipped kernel zero-padded to tile x tile: a circular convolution of a
+    // tile with it is the correlation, shifted by size - 1, in the rows and
+    // columns from size - 1 on
+    void prepareSpectrum(int tile) {
+        fft.init(tile);
+        fftBlock = tile - size + 1;
+        spectrum.assign(2 * static_cast<size_t>(tile) * tile, 0.0f);
+        for (int a = 0; a < size; a++)
+            for (int b = 0; b < size; b++)
+                spectrum[2 * (static_cast<size_t>(size - 1 - a) * tile + (size - 1 - b))] = taps[static_cast<size_t>(a) * size + b];
+        fft.transform2D(spectrum.data(), false);
+
+        float scale = 1.0f / (static_cast<float>(tile) * tile);
+        for (float& value : spectrum)
+            value *= scale;
+    }
+};
+
+template <typename T>
+inline T roundPixel(float value, int maxGray) {
+    value = min(max(value, 0.0f), static_cast<float>(maxGray));
+    return static_cast<T>(value + 0.5f);
+}
+
+// Direct and separable strategies. A ring of size float rows holds the source
+// rows in the window, each padded by radius replicated columns on both sides.
+template <typename T>
+void convolutionRows(const PixelBuffer& src, PixelBuffer& out, const ConvolutionKernel& kernel, int maxGray,
+    int rowBegin, int rowEnd) {
+    int rows = src.rows, cols = src.cols;
+    int n = kernel.size, r = kernel.radius;
+    size_t paddedCols = static_cast<size_t>(cols) + 2 * r;
+    static thread_local vector<float> ring, accumulator, columnPass;
+    static thread_local vector<int> ringRow;
+    ring.assign(paddedCols * n, 0.0f);
+    accumulator.assign(cols, 0.0f);
+    columnPass.assign(paddedCols, 0.0f);
+    ringRow.assign(n, INT_MIN);
+
+    auto paddedRow = [&](int y) -> const float* {
+        int slot = ((y % n) + n) % n;
+        float* padded = &ring[slot * paddedCols];
+        if (ringRow[slot] != y) {
+            const T* source = src.row<T>(borderIndex(y, rows, BorderReplicate));
+            for (int j = 0; j < cols; j++)
+                padded[r + j] = source[j];
+            for (int k = 0; k < r; k++) {
+                padded[k] = source[borderIndex(k - r, cols, BorderReplicate)];
+                padded[r + cols + k] = source[borderIndex(cols + k, cols, BorderReplicate)];
+            }
+            ringRow[slot] = y;
+        }
+        return padded;
+    };
+
+    for (int i = rowBegin; i < rowEnd; i++) {
+        fill(accumulator.begin(), accumulator.end(), 0.0f);
+        float* acc = accumulator.data();
+
+        if (kernel.strategy == ConvolutionSeparable) {
+            for (size_t term = 0; term < kernel.columnFactors.size(); term++) {
+                const vector<float>& column = kernel.columnFactors[term];
+                const vector<float>& row = kernel.rowFactors[term];
+                float* pass = columnPass.data();
+                fill(columnPass.begin(), columnPass.end(), 0.0f);
+                for (int a = 0; a < n; a++) {
+                    const float* source = paddedRow(i - r + a);
+                    float weight = column[a];
+                    for (size_t p = 0; p < paddedCols; p++)
+                        pass[p] += weight * source[p];
+                }
+                for (int b = 0; b < n; b++) {
+                    float weight = row[b];
+                    const float* source = pass + b;
+                    for (int j = 0; j < cols; j++)
+                        acc[j] += weight * source[j];
+                }
+            }
+        }
+        else {
+            for (int a = 0; a < n; a++) {
+                const float* source = paddedRow(i - r + a);
+                const float* weights = &kernel.taps[static_cast<size_t>(a) * n];
+                for (int b = 0; b < n; b++) {
+                    float weight = weights[b];
+                    if (weight == 0.0f)
+                        continue;
+                    for (int j = 0; j < cols; j++)
+                        acc[j] += weight * source[b + j];
+                }
+            }
+        }
+
+        T* result = out.row<T>(i);
+        for (int j = 0; j < cols; j++)
+            result[j] = roundPixel<T>(acc[j], maxGray);
+    }
+}
+
+// FFT overlap-save. Output tiles are fftBlock x fftBlock on a fixed grid from
+// the origin; each reads a tile x tile window (its halo included) and two
+// tiles travel in one complex transform, one in the real and one in the
+// imaginary part, since the kernel is real. Works on tile rows
+// [tileRowBegin, tileRowEnd).
+template <typename T>
+void fftConvolutionTileRows(const PixelBuffer& src, PixelBuffer& out, const ConvolutionKernel& kernel, int maxGray,
+    int tileRowBegin, int tileRowEnd) {
+    int rows = src.rows, cols = src.cols;
+    int tile = kernel.fft.size, block = kernel.fftBlock, r = kernel.radius;
+    int shift = kernel.size - 1;
+    int tileCols = (cols + block - 1) / block;
+    static thread_local vector<float> buffer;
+    static thread_local vector<int> sourceCol;
+    buffer.assign(2 * static_cast<size_t>(tile) * tile, 0.0f);
+    sourceCol.resize(tile);
+
+    for (int ty = tileRowBegin; ty < tileRowEnd; ty++) {
+        int row0 = ty * block;
+        int outRows = min(block, rows - row0);
+
+        for (int tx = 0; tx < tileCols; tx += 2) {
+            int tileCount = min(2, tileCols - tx);
+            for (int part = 0; part < 2; part++) {
+                if (part == tileCount) {
+                    for (int y = 0; y < tile; y++) {
+                        float* line = &buffer[2 * static_cast<size_t>(y) * tile];
+                        for (int x = 0; x < tile; x++)
+                            line[2 * x + 1] = 0.0f;
+                    }
+                    break;
+                }
+                int col0 = (tx + part) * block;
+                for (int x = 0; x < tile; x++)
+                    sourceCol[x] = borderIndex(col0 - r + x, cols, BorderReplicate);
+                for (int y = 0; y < tile; y++) {
+                    const T* source = src.row<T>(borderIndex(row0 - r + y, rows, BorderReplicate));
+                    float* line = &buffer[2 * static_cast<size_t>(y) * tile + part];
+                    for (int x = 0; x < tile; x++)
+                        line[2 * x] = source[sourceCol[x]];
+                }
+            }
+
+            kernel.fft.transform2D(buffer.data(), false);
+            const float* k = kernel.spectrum.data();
+            float* z = buffer.data();
+            for (size_t m = 0; m < static_cast<size_t>(tile) * tile; m++) {
+                float re = z[2 * m] * k[2 * m] - z[2 * m + 1] * k[2 * m + 1];
+                float im = z[2 * m] * k[2 * m + 1] + z[2 * m + 1] * k[2 * m];
+                z[2 * m] = re;
+                z[2 * m + 1] = im;
+            }
+            kernel.fft.transform2D(buffer.data(), true);
+
+            for (int part = 0; part < tileCount; part++) {
+                int col0 = (tx + part) * block;
+                int outCols = min(block, cols - col0);
+                for (int y = 0; y < outRows; y++) {
+                    const float* line = &buffer[2 * (static_cast<size_t>(y + shift) * tile + shift) + part];
+                    T* result = out.row<T>(row0 + y) + col0;
+                    for (int x = 0; x < outCols; x++)
+                        result[x] = roundPixel<T>(line[2 * x], maxGray);
+                }
+            }
+        }
+    }
+}
+
+// RESAMPLING
+// Separable resampling with the filter taps for every output row and column
+// computed once. Output pixel i covers source coordinates [i, i + 1) * scale,
+// scale = 1 / ratio; when shrinking, the filter is stretched by scale so every
+// source pixel contributes (no aliasing). Taps falling outside the image are
+// dropped and the rest renormalized. Integer downscales with the area filter
+// take a direct block-averaging path.
+enum ResampleFilter { ResampleAuto, ResampleNearest, ResampleBilinear, ResampleBicubic, ResampleLanczos3, ResampleArea };
+
+inline double resampleSupport(ResampleFilter filter) {
+    switch (filter) {
+    case ResampleBilinear: return 1.0;
+    case ResampleBicubic: return 2.0;
+    case ResampleLanczos3: return 3.0;
+    default: return 0.5;
+    }
+}
+
+inline double resampleWeight(ResampleFilter filter, double x) {
+    // The box is half-open so a sample exactly between two pixels takes one
+    if (filter == ResampleArea || filter == ResampleNearest)
+        return x >= -0.5 && x < 0.5 ? 1.0 : 0.0;
+
+    x = fabs(x);
+    switch (filter) {
+    case ResampleBilinear:
+        return x < 1.0 ? 1.0 - x : 0.0;
+    case ResampleBicubic:
+        // Keys cubic convolution, a = -0.5
+        if (x < 1.0)
+            return (1.5 * x - 2.5) * x * x + 1.0;
+        if (x < 2.0)
+            return ((-0.5 * x + 2.5) * x - 4.0) * x + 2.0;
+        return 0.0;
+    case ResampleLanczos3: {
+        if (x >= 3.0)
+            return 0.0;
+        if (x < 1e-8)
+            return 1.0;
+        double px = acos(-1.0) * x;
+        return 3.0 * sin(px) * sin(px / 3.0) / (px * px);
+    }
+    default:
+        return 0.0;
+    }
+}
+
+// Taps of one axis: output i reads count[i] source pixels from first[i]
+struct ResampleTaps {
+    vector<int> first, count;
+    vector<float> weights;      // maxTaps per output index
+    int maxTaps = 0;
+
+    void build(int srcSize, int dstSize, double scale, ResampleFilter filter) {
+        double stretch = max(scale, 1.0);
+        double support = resampleSupport(filter) * stretch;
+        maxTaps = static_cast<int>(ceil(2.0 * support)) + 2;
+        first.assign(dstSize, 0);
+        count.assign(dstSize, 0);
+        weights.assign(static_cast<size_t>(dstSize) * maxTaps, 0.0f);
+
+        vector<double> raw(maxTaps);
+        for (int i = 0; i < dstSize; i++) {
+            double center = (i + 0.5) * scale;
+            int lo = max(0, static_cast<int>(floor(center - support)));
+            int hi = min(srcSize, static_cast<int>(ceil(center + support)) + 1);
+            hi = min(hi, lo + maxTaps);
+
+            double total = 0.0;
+            int n = 0;
+            for (int k = lo; k < hi; k++) {
+                raw[n] = resampleWeight(filter, (k + 0.5 - center) / stretch);
+                total += raw[n++];
+            }
+            // Trim zero taps at both ends so the inner loops stay short
+            int skip = 0;
+            while (skip < n - 1 && raw[skip] == 0.0)
+                skip++;
+            while (n - 1 > skip && raw[n - 1] == 0.0)
+                n--;
+            if (total == 0.0) {
+                // Defensive: no source pixel carries weight, take the nearest
+                first[i] = min(max(static_cast<int>(center), 0), srcSize - 1);
+                count[i] = 1;
+                weights[static_cast<size_t>(i) * maxTaps] = 1.0f;
+                continue;
+            }
+
+            first[i] = lo + skip;
+            count[i] = n - skip;
+            for (int k = skip; k < n; k++)
+                weights[static_cast<size_t>(i) * maxTaps + k - skip] = static_cast<float>(raw[k] / total);
+        }
+    }
+};
+
+// Output rows [rowBegin, rowEnd): the horizontal pass runs over just the
+// source rows they read, into a float band, then the vertical pass combines
+// whole band rows four columns at a time.
+template <typename T>
+void resampleRows(const PixelBuffer& src, PixelBuffer& out, const ResampleTaps& rowTaps, const ResampleTaps& colTaps,
+    int maxGray, int rowBegin, int rowEnd) {
+    int dstCols = out.cols;
+    int srcLo = INT_MAX, srcHi = 0;
+    for (int i = rowBegin; i < rowEnd; i++) {
+        srcLo = min(srcLo, rowTaps.first[i]);
+        srcHi = max(srcHi, rowTaps.first[i] + rowTaps.count[i]);
+    }
+    if (srcLo >= srcHi)
+        return;
+
+    static thread_local vector<float> band, accumulator;
+    band.assign(static_cast<size_t>(srcHi - srcLo) * dstCols, 0.0f);
+    accumulator.assign(dstCols, 0.0f);
+    for (int y = srcLo; y < srcHi; y++) {
+        const T* source = src.row<T>(y);
+        float* line = &band[static_cast<size_t>(y - srcLo) * dstCols];
+        for (int j = 0; j < dstCols; j++) {
+            const T* pixels = source + colTaps.first[j];
+            const float* weights = &colTaps.weights[static_cast<size_t>(j) * colTaps.maxTaps];
+            float sum = 0.0f;
+            for (int k = 0; k < colTaps.count[j]; k++)
+                sum += weights[k] * pixels[k];
+            line[j] = sum;
+        }
+    }
+
+    for (int i = rowBegin; i < rowEnd; i++) {
+        float* acc = accumulator.data();
+        const float* weights = &rowTaps.weights[static_cast<size_t>(i) * rowTaps.maxTaps];
+        const float* base = &band[static_cast<size_t>(rowTaps.first[i] - srcLo) * dstCols];
+        int j = 0;
+#ifdef __SSE2__
+        for (; j + 4 <= dstCols; j += 4) {
+            __m128 sum = _mm_setzero_ps();
+            for (int k = 0; k < rowTaps.count[i]; k++)
+                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[k]), _mm_loadu_ps(base + static_cast<size_t>(k) * dstCols + j)));
+            _mm_storeu_ps(acc + j, sum);
+        }
+#endif
+        for (; j < dstCols; j++) {
+            float sum = 0.0f;
+            for (int k = 0; k < rowTaps.count[i]; k++)
+                sum += weights[k] * base[static_cast<size_t>(k) * dstCols + j];
+            acc[j] = sum;
+        }
+
+        T* result = out.row<T>(i);
+        for (j = 0; j < dstCols; j++)
+            result[j] = roundPixel<T>(acc[j], maxGray);
+    }
+}
+
+// Integer downscale by factor with the area filter: each output pixel is the
+// rounded mean of a factor x factor block
+template <typename T>
+void areaDownscaleRows(const PixelBuffer& src, PixelBuffer& out, int factor, int rowBegin, int rowEnd) {
+    int dstCols = out.cols;
+    uint32_t area = static_cast<uint32_t>(factor) * factor;
+    static thread_local vector<uint32_t> columnSums;
+    columnSums.assign(static_cast<size_t>(dstCols) * factor, 0);
+
+    for (int i = rowBegin; i < rowEnd; i++) {
+        T* result = out.row<T>(i);
+        const T* top = src.row<T>(i * factor);
+        int j = 0;
+#ifdef __SSE2__
+        if (factor == 2 && sizeof(T) == 1) {
+            // Pair sums of both rows in 16-bit lanes, then the pairs of those
+            const T* bottom = src.row<T>(i * factor + 1);
+            const __m128i low = _mm_set1_epi16(0xff), zero = _mm_setzero_si128(), two = _mm_set1_epi16(2);
+            for (; j + 8 <= dstCols; j += 8) {
+                __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(top + 2 * j));
+                __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bottom + 2 * j));
+                __m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a, low), _mm_srli_epi16(a, 8)),
+                    _mm_add_epi16(_mm_and_si128(b, low), _mm_srli_epi16(b, 8)));
+                sum = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(result + j), _mm_packus_epi16(sum, zero));
+            }
+        }
+        else if (factor == 2) {
+            // The same in 32-bit lanes; the means are biased by 0x8000 so the
+            // signed pack keeps all 16 bits
+            const T* bottom = src.row<T>(i * factor + 1);
+            const __m128i low = _mm_set1_epi32(0xffff), two = _mm_set1_epi32(2), bias = _mm_set1_epi32(0x8000);
+            auto means = [&](const T* up, const T* down) {
+                __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(up));
+                __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(down));
+                __m128i sum = _mm_add_epi32(_mm_add_epi32(_mm_and_si128(a, low), _mm_srli_epi32(a, 16)),
+                    _mm_add_epi32(_mm_and_si128(b, low), _mm_srli_epi32(b, 16)));
+                return _mm_sub_epi32(_mm_srli_epi32(_mm_add_epi32(sum, two), 2), bias);
+            };
+            for (; j + 8 <= dstCols; j += 8) {
+                __m128i packed = _mm_packs_epi32(means(top + 2 * j, bottom + 2 * j), means(top + 2 * j + 8, bottom + 2 * j + 8));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(result + j), _mm_xor_si128(packed, _mm_set1_epi16(static_cast<short>(0x8000))));
+            }
+        }
+#endif
+        if (j < dstCols) {
+            // Column sums only for the blocks the vector loop did not cover
+            size_t first = static_cast<size_t>(j) * factor, used = static_cast<size_t>(dstCols) * factor;
+            fill(columnSums.begin() + first, columnSums.begin() + used, 0);
+            for (int k = 0; k < factor; k++) {
+                const T* source = src.row<T>(i * factor + k);
+                for (size_t c = first; c < used; c++)
+                    columnSums[c] += source[c];
+            }
+            for (; j < dstCols; j++) {
+                uint32_t sum = 0;
+                for (int k = 0; k < factor; k++)
+                    sum += columnSums[static_cast<size_t>(j) * factor + k];
+                result[j] = static_cast<T>((sum + area / 2) / area);
+            }
+        }
+    }
+}
+
+// Nearest neighbour: output (i, j) takes source (i / ratio, j / ratio)
+PixelBuffer resampleNearestPixels(const PixelBuffer& src, int newRows, int newCols, double ratio) {
+    vector<int> sourceCols(newCols);
+    for (int j = 0; j < newCols; ++j)
+        sourceCols[j] = min(static_cast<int>(j / ratio), src.cols - 1);
+
+    PixelBuffer resized;
+    resized.allocate(newRows, newCols, src.bytesPerPixel, false);
+
+    dispatchPixels(src.bytesPerPixel, [&](auto zero) {
+        using T = decltype(zero);
+        parallelRows(newRows, static_cast<size_t>(newCols) * sizeof(T), 0, [&](int rowBegin, int rowEnd) {
+            for (int i = rowBegin; i < rowEnd; ++i) {
+                const T* source = src.row<T>(min(static_cast<int>(i / ratio), src.rows - 1));
+                T* out = resized.row<T>(i);
+                for (int j = 0; j < newCols; ++j)
+                    out[j] = source[sourceCols[j]];
+            }
+        });
+    });
+    return resized;
+}
+
+// Filtered resampling to newRows x newCols, scale source pixels per output
+// pixel. Auto averages blocks for integer downscales and uses bicubic otherwise.
+PixelBuffer resamplePixels(const PixelBuffer& src, int newRows, int newCols, double scale, ResampleFilter filter,
+    int maxGray) {
+    int factor = static_cast<int>(scale + 0.5);
+    bool integerDownscale = factor >= 2 && fabs(scale - factor) < 1e-9;
+    if (filter == ResampleAuto)
+        filter = integerDownscale ? ResampleArea : ResampleBicubic;
+
+    PixelBuffer resized;
+    resized.allocate(newRows, newCols, src.bytesPerPixel, false);
+
+    // Whole blocks only; a result clamped to one row or column goes through the taps
+    if (filter == ResampleArea && integerDownscale && newRows * factor <= src.rows && newCols * factor <= src.cols) {
+        dispatchPixels(src.bytesPerPixel, [&](auto zero) {
+            using T = decltype(zero);
+            parallelRows(newRows, static_cast<size_t>(newCols) * sizeof(T), 0, [&](int rowBegin, int rowEnd) {
+                areaDownscaleRows<T>(src, resized, factor, rowBegin, rowEnd);
+            });
+        });
+        return resized;
+    }
+
+    ResampleTaps rowTaps, colTaps;
+    rowTaps.build(src.rows, newRows, scale, filter);
+    colTaps.build(src.cols, newCols, scale, filter);
+    // A band re-reads maxTaps source rows, worth maxTaps / scale output rows
+    int halo = static_cast<int>(ceil(rowTaps.maxTaps / scale));
+    dispatchPixels(src.bytesPerPixel, [&](auto zero) {
+        using T = decltype(zero);
+        parallelRows(newRows, static_cast<size_t>(newCols) * sizeof(T), min(halo, 64), [&](int rowBegin, int rowEnd) {
+            resampleRows<T>(src, resized, rowTaps, colTaps, maxGray, rowBegin, rowEnd);
+        });
+    });
+    return resized;
+}
+
+// BINARY MASK
+// One bit per pixel, 64 pixels to a word with the leftmost pixel in the low
+// bit; bits past cols in the last word of a row are always 0. Erosion and
+// dilation take the AND / OR of the pixels under the structuring element.
+// Pixels outside the mask count as set for erosion and clear for dilation,
+// so the border neither eats into shapes nor grows them. Rectangles are
+// separable: the horizontal pass combines a whole row of words with shifted
+// copies of itself, doubling the run length each step (log2 width steps), and
+// the vertical pass is van Herk / Gil-Werman over rows of words (three word
+// operations per word whatever the height). A cross is the union of a
+// horizontal and a vertical line, so it erodes to the AND of the two passes
+// and dilates to their OR.
+enum MorphologyOperation { MorphologyErode, MorphologyDilate, MorphologyOpen, MorphologyClose };
+enum MorphologyShape { MorphologyRect, MorphologyCross };
+
+struct BinaryMask {
+    int rows = 0, cols = 0;
+    size_t wordsPerRow = 0;
+    vector<uint64_t> bits;
+
+    bool empty() const {
+        return bits.empty();
+    }
+
+    void clear() {
+        *this = BinaryMask();
+    }
+
+    void resize(int newRows, int newCols) {
+        rows = newRows;
+        cols = newCols;
+        wordsPerRow = (static_cast<size_t>(cols) + 63) / 64;
+        bits.assign(wordsPerRow * rows, 0);
+    }
+
+    uint64_t* row(int r) {
+        return bits.data() + wordsPerRow * r;
+    }
+
+    const uint64_t* row(int r) const {
+        return bits.data() + wordsPerRow * r;
+    }
+
+    uint64_t tailMask() const {
+        return cols % 64 == 0 ? ~0ULL : (1ULL << (cols % 64)) - 1;
+    }
+
+    // Bits [start, end) of a row, start < end
+    static uint64_t rangeWord(size_t w, int start, int end) {
+        uint64_t mask = ~0ULL;
+        if (w == static_cast<size_t>(start) / 64)
+            mask &= ~0ULL << (start % 64);
+        if (w == static_cast<size_t>(end - 1) / 64)
+            mask &= ~0ULL >> (63 - (end - 1) % 64);
+        return mask;
+    }
+
+    static void setRange(uint64_t* bitsRow, int start, int end) {
+        for (size_t w = static_cast<size_t>(start) / 64; w <= static_cast<size_t>(end - 1) / 64; w++)
+            bitsRow[w] |= rangeWord(w, start, end);
+    }
+
+    static bool anyInRange(const uint64_t* bitsRow, int start, int end) {
+        for (size_t w = static_cast<size_t>(start) / 64; w <= static_cast<size_t>(end - 1) / 64; w++)
+            if (bitsRow[w] & rangeWord(w, start, end))
+                return true;
+        return false;
+    }
+
+    // Sets the pixels that are at least threshold, as convertToBinary does
+    void pack(const PixelBuffer& pixels, int threshold) {
+        resize(pixels.rows, pixels.cols);
+        if (cols == 0)
+            return;
+        dispatchPixels(pixels.bytesPerPixel, [&](auto zero) {
+            using T = decltype(zero);
+            parallelRows(rows, static_cast<size_t>(cols) * sizeof(T), 0, [&](int rowBegin, int rowEnd) {
+                for (int r = rowBegin; r < rowEnd; r++) {
+                    const T* src = pixels.row<T>(r);
+                    uint64_t* dst = row(r);
+                    int c = 0;
+#ifdef __SSE2__
+                    if (sizeof(T) == 1 && threshold > 0 && threshold <= 255) {
+                        __m128i limit = _mm_set1_epi8(static_cast<char>(threshold));
+                        for (; c + 64 <= cols; c += 64) {
+                            uint64_t word = 0;
+                            for (int k = 0; k < 4; k++) {
+                                __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + c + 16 * k));
+                                uint64_t set = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(p, limit), p)));
+                                word |= set << (16 * k);
+                            }
+                            dst[c / 64] = word;
+                        }
+                    }
+                    if (sizeof(T) == 2 && threshold > 0 && threshold <= 65535) {
+                        // Unsigned compare through the signed one with the sign bits flipped
+                        __m128i bias = _mm_set1_epi16(static_cast<short>(0x8000));
+                        __m128i limit = _mm_set1_epi16(static_cast<short>((threshold - 1) ^ 0x8000));
+                        for (; c + 64 <= cols; c += 64) {
+                            uint64_t word = 0;
+                            for (int k = 0; k < 4; k++) {
+                                const __m128i* p = reinterpret_cast<const __m128i*>(src + c + 16 * k);
+                                __m128i low = _mm_cmpgt_epi16(_mm_xor_si128(_mm_loadu_si128(p), bias), limit);
+                                __m128i high = _mm_cmpgt_epi16(_mm_xor_si128(_mm_loadu_si128(p + 1), bias), limit);
+                                uint64_t set = static_cast<unsigned>(_mm_movemask_epi8(_mm_packs_epi16(low, high)));
+                                word |= set << (16 * k);
+                            }
+                            dst[c / 64] = word;
+                        }
+                    }
+#endif
+                    for (; c < cols; c++)
+                        if (src[c] >= threshold)
+                            dst[c / 64] |= 1ULL << (c % 64);
+                }
+            });
+        });
+    }
+
+    // Byte b of the mask spread to eight bytes of 0x00 / 0xFF
+    static const array<uint64_t, 256>& byteSpread() {
+        static const array<uint64_t, 256> table = [] {
+            array<uint64_t, 256> spread{};
+            for (int b = 0; b < 256; b++)
+                for (int k = 0; k < 8; k++)
+                    if (b & (1 << k))
+                        spread[b] |= 0xFFULL << (8 * k);
+            return spread;
+        }();
+        return table;
+    }
+
+    // Grayscale copy with set pixels at maxGray. 8-bit output expands a byte
+    // of the mask to eight pixels with one table lookup.
+    PixelBuffer unpack(int maxGray) const {
+        PixelBuffer pixels;
+        pixels.allocate(rows, cols, bytesForMaxGray(maxGray), false);
+        const array<uint64_t, 256>& spread = byteSpread();
+
+        dispatchPixels(pixels.bytesPerPixel, [&](auto zero) {
+            using T = decltype(zero);
+            parallelRows(rows, static_cast<size_t>(cols) * sizeof(T), 0, [&](int rowBegin, int rowEnd) {
+                uint64_t fillBytes = 0x0101010101010101ULL * static_cast<uint8_t>(maxGray);
+                for (int r = rowBegin; r < rowEnd; r++) {
+                    const uint64_t* src = row(r);
+                    T* dst = pixels.row<T>(r);
+                    int c = 0;
+                    if (sizeof(T) == 1 && !hostIsBigEndian())
+                        for (; c + 8 <= cols; c += 8) {
+                            uint64_t expanded = spread[(src[c / 64] >> (c % 64)) & 0xFF] & fillBytes;
+                            memcpy(dst + c, &expanded, 8);
+                        }
+                    for (; c < cols; c++)
+                        dst[c] = static_cast<T>((src[c / 64] >> (c % 64)) & 1 ? maxGray : 0);
+                }
+            });
+        });
+        return pixels;
+    }
+
+    // dst bit j = src bit (j + shift), with fill for bits from outside src;
+    // src must hold fill in its bits past the end of the row
+    static void shiftRow(const uint64_t* src, size_t srcWords, uint64_t* dst, size_t dstWords, long long shift, uint64_t fill) {
+        long long wordShift = shift >= 0 ? shift / 64 : -((-shift + 63) / 64);
+        int bitShift = static_cast<int>(shift - wordShift * 64);
+        auto word = [&](long long w) { return w >= 0 && w < static_cast<long long>(srcWords) ? src[w] : fill; };
+        for (size_t w = 0; w < dstWords; w++) {
+            long long from = static_cast<long long>(w) + wordShift;
+            dst[w] = bitShift == 0 ? word(from) : (word(from) >> bitShift) | (word(from + 1) << (64 - bitShift));
+        }
+    }
+
+    // Combines every pixel with left pixels before and right after it. Each
+    // row is copied into a row extended by left + right bits of fill, where
+    // run (covering [j, j + length)) doubles until the runs that make up the
+    // width have been folded into result (covering [j, j + offset)).
+    void horizontalPass(bool erode, int left, int right) {
+        if (left == 0 && right == 0)
+            return;
+        uint64_t fill = erode ? ~0ULL : 0;
+        uint64_t tail = tailMask();
+        long long width = static_cast<long long>(left) + right + 1;
+        size_t extendedWords = (static_cast<size_t>(cols) + left + right + 63) / 64;
+        parallelRows(rows, wordsPerRow * 8, 0, [&](int rowBegin, int rowEnd) {
+            static thread_local vector<uint64_t> run, result, shifted;
+            run.resize(extendedWords);
+            result.resize(extendedWords);
+            shifted.resize(extendedWords);
+            for (int r = rowBegin; r < rowEnd; r++) {
+                uint64_t* bitsRow = row(r);
+                uint64_t last = bitsRow[wordsPerRow - 1];
+                bitsRow[wordsPerRow - 1] = (last & tail) | (fill & ~tail);
+                shiftRow(bitsRow, wordsPerRow, run.data(), extendedWords, -left, fill);
+                fill_n(result.begin(), extendedWords, fill);
+
+                long long offset = 0;
+                for (long long length = 1;; length *= 2) {
+                    if (width & length) {
+                        shiftRow(run.data(), extendedWords, shifted.data(), extendedWords, offset, fill);
+                        for (size_t w = 0; w < extendedWords; w++)
+                            result[w] = erode ? result[w] & shifted[w] : result[w] | shifted[w];
+                        offset += length;
+                    }
+                    if (length * 2 > width)
+                        break;
+                    shiftRow(run.data(), extendedWords, shifted.data(), extendedWords, length, fill);
+                    for (size_t w = 0; w < extendedWords; w++)
+                        run[w] = erode ? run[w] & shifted[w] : run[w] | shifted[w];
+                }
+
+                copy(result.begin(), result.begin() + wordsPerRow, bitsRow);
+                bitsRow[wordsPerRow - 1] &= tail;
+            }
+        });
+    }
+
+    // van Herk / Gil-Werman down each column of words. Extended row e is mask
+    // row e - top (fill outside); within blocks of height rows, prefix[e] and
+    // suffix[e] combine from the block start to e and from e to the block end,
+    // so the window [y, y + height) is suffix[y] with prefix[y + height - 1].
+    void verticalPass(bool erode, int top, int bottom) {
+        if (top == 0 && bottom == 0)
+            return;
+        uint64_t fill = erode ? ~0ULL : 0;
+        int height = top + bottom + 1;
+        int extended = rows + height - 1;
+        parallelRows(static_cast<int>(wordsPerRow), static_cast<size_t>(rows) * 8, 0, [&](int wordBegin, int wordEnd) {
+            static thread_local vector<uint64_t> prefix, suffix;
+            prefix.resize(extended);
+            suffix.resize(extended);
+            for (int w = wordBegin; w < wordEnd; w++) {
+                auto source = [&](int e) {
+                    int y = e - top;
+                    return y >= 0 && y < rows ? bits[wordsPerRow * y + w] : fill;
+                };
+                for (int e = 0; e < extended; e++)
+                    prefix[e] = e % height == 0 ? source(e) : erode ? prefix[e - 1] & source(e) : prefix[e - 1] | source(e);
+                for (int e = extended - 1; e >= 0; e--)
+                    suffix[e] = e % height == height - 1 || e == extended - 1 ? source(e)
+                        : erode ? suffix[e + 1] & source(e) : suffix[e + 1] | source(e);
+                for (int y = 0; y < rows; y++)
+                    bits[wordsPerRow * y + w] = erode ? suffix[y] & prefix[y + height - 1] : suffix[y] | prefix[y + height - 1];
+            }
+        });
+    }
+
+    // Erodes or dilates by a width x height rectangle or cross centred on the
+    // pixel; the extra column / row of even sizes lies right / down of it.
+    // Dilation uses the reflected element so opening and closing are idempotent.
+    void morph(bool erode, MorphologyShape shape, int width, int height) {
+        int left = (width - 1) / 2, right = width - 1 - left;
+        int top = (height - 1) / 2, bottom = height - 1 - top;
+        if (!erode) {
+            swap(left, right);
+            swap(top, bottom);
+        }
+        if (shape == MorphologyRect) {
+            horizontalPass(erode, left, right);
+            verticalPass(erode, top, bottom);
+            return;
+        }
+
+        BinaryMask vertical = *this;
+        horizontalPass(erode, left, right);
+        vertical.verticalPass(erode, top, bottom);
+        for (size_t w = 0; w < bits.size(); w++)
+            bits[w] = erode ? bits[w] & vertical.bits[w] : bits[w] | vertical.bits[w];
+    }
+
+    void apply(MorphologyOperation operation, MorphologyShape shape, int width, int height) {
+        if (empty())
+            return;
+        if (operation == MorphologyErode || operation == MorphologyOpen)
+            morph(true, shape, width, height);
+        if (operation != MorphologyErode)
+            morph(false, shape, width, height);
+        if (operation == MorphologyClose)
+            morph(true, shape, width, height);
+    }
+};
+
+// CONNECTED COMPONENTS
+// Run-based labeling of a BinaryMask. Rows are split into strips, one task
+// each: a strip lists its runs of set pixels and unions every run with the
+// runs it touches in the row above (overlapping columns for 4-connectivity,
+// overlapping or diagonal for 8). A merge step then unions the runs across
+// each strip boundary. Roots always link to the smaller run index, so a
+// component's root is its first run in raster order, and labels 1, 2, ...
+// follow the order in which components are first met whatever the strips.
+// Area, bounding box and centroid come out of the same pass over the runs.
+// Index of the lowest set bit of a non-zero word
+inline int lowestSetBit(uint64_t word) {
+#ifdef __GNUC__
+    return __builtin_ctzll(word);
+#else
+    int bit = 0;
+    while (!(word & 1)) {
+        word >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+struct ComponentStats {
+    uint32_t label = 0;
+    long long area = 0;
+    int left = INT_MAX, top = INT_MAX, right = -1, bottom = -1;
+    long long sumX = 0, sumY = 0;       // centroid = sum / area
+};
+
+struct ComponentLabeling {
+    struct Run {
+        int start, end;                 // columns [start, end)
+    };
+
+    struct Strip {
+        int rowBegin = 0, rowEnd = 0;
+        vector<Run> runs;
+        vector<uint32_t> rowFirst;      // runs of row rowBegin + k start at rowFirst[k]
+        uint32_t firstRun = 0;          // index of runs[0] among all runs
+    };
+
+    vector<Strip> strips;
+    vector<uint32_t> parent;            // union-find over all runs
+    vector<uint32_t> runLabel;
+    vector<ComponentStats> components;
+
+    static uint32_t find(vector<uint32_t>& parents, uint32_t x) {
+        while (parents[x] != x) {
+            parents[x] = parents[parents[x]];
+            x = parents[x];
+        }
+        return x;
+    }
+
+    static void unite(vector<uint32_t>& parents, uint32_t a, uint32_t b) {
+        a = find(parents, a);
+        b = find(parents, b);
+        if (a < b)
+            parents[b] = a;
+        else if (b < a)
+            parents[a] = b;
+    }
+
+    // Unions each run of one row (indices from first) with the runs of the row
+    // above (from firstAbove) that it touches; reach is 0 or 1 for 4 or 8
+    static void uniteRows(vector<uint32_t>& parents, const Run* above, size_t aboveCount, uint32_t firstAbove,
+        const Run* current, size_t count, uint32_t first, int reach) {
+        size_t a = 0;
+        for (size_t k = 0; k < count; k++) {
+            while (a < aboveCount && above[a].end + reach <= current[k].start)
+                a++;
+            for (size_t b = a; b < aboveCount && above[b].start < current[k].end + reach; b++)
+                unite(parents, first + static_cast<uint32_t>(k), firstAbove + static_cast<uint32_t>(b));
+        }
+    }
+
+    static void findRuns(const uint64_t* bits, int cols, vector<Run>& runs) {
+        int c = 0;
+        size_t words = (static_cast<size_t>(cols) + 63) / 64;
+        auto next = [&](int from, bool set) {
+            size_t w = static_cast<size_t>(from) / 64;
+            if (w >= words)
+                return cols;
+            uint64_t word = (set ? bits[w] : ~bits[w]) & (~0ULL << (from % 64));
+            while (word == 0) {
+                if (++w >= words)
+                    return cols;
+                word = set ? bits[w] : ~bits[w];
+            }
+            return min(cols, static_cast<int>(w * 64) + lowestSetBit(word));
+        };
+        while (c < cols) {
+            int start = next(c, true);
+            if (start >= cols)
+                break;
+            c = next(start, false);
+            runs.push_back({ start, c });
+        }
+    }
+
+    // Finds the runs and unions them into components; returns the run count
+    uint32_t connect(const BinaryMask& mask, int connectivity) {
+        int reach = connectivity == 8 ? 1 : 0;
+        ThreadPool& pool = ThreadPool::instance();
+        int stripCount = max(1, min(mask.rows, 4 * pool.threadCount()));
+        strips.assign(stripCount, Strip());
+
+        pool.run(stripCount, [&](int s) {
+            Strip& strip = strips[s];
+            strip.rowBegin = static_cast<int>(static_cast<long long>(mask.rows) * s / stripCount);
+            strip.rowEnd = static_cast<int>(static_cast<long long>(mask.rows) * (s + 1) / stripCount);
+            strip.rowFirst.push_back(0);
+            for (int r = strip.rowBegin; r < strip.rowEnd; r++) {
+                findRuns(mask.row(r), mask.cols, strip.runs);
+                strip.rowFirst.push_back(static_cast<uint32_t>(strip.runs.size()));
+            }
+        });
+
+        uint32_t total = 0;
+        for (Strip& strip : strips) {
+            strip.firstRun = total;
+            total += static_cast<uint32_t>(strip.runs.size());
+        }
+        parent.resize(total);
+
+        // Each strip only links runs inside it, so the strips do not overlap
+        pool.run(stripCount, [&](int s) {
+            Strip& strip = strips[s];
+            for (uint32_t k = 0; k < strip.runs.size(); k++)
+                parent[strip.firstRun + k] = strip.firstRun + k;
+            for (size_t row = 1; row + 1 < strip.rowFirst.size(); row++)
+                uniteRows(parent, strip.runs.data() + strip.rowFirst[row - 1], strip.rowFirst[row] - strip.rowFirst[row - 1],
+                    strip.firstRun + strip.rowFirst[row - 1], strip.runs.data() + strip.rowFirst[row],
+                    strip.rowFirst[row + 1] - strip.rowFirst[row], strip.firstRun + strip.rowFirst[row], reach);
+        });
+
+        // Merge across strip boundaries (the last row above with the first below)
+        const Strip* above = nullptr;
+        for (const Strip& strip : strips) {
+            if (strip.rowEnd == strip.rowBegin)
+                continue;
+            if (above != nullptr) {
+                size_t lastRow = above->rowFirst.size() - 2;
+                uint32_t aboveFirst = above->rowFirst[lastRow];
+                uniteRows(parent, above->runs.data() + aboveFirst, above->rowFirst[lastRow + 1] - aboveFirst,
+                    above->firstRun + aboveFirst, strip.runs.data(), strip.rowFirst[1], strip.firstRun, reach);
+            }
+            above = &strip;
+        }
+        return total;
+    }
+
+    // Returns the number of components
+    size_t label(const BinaryMask& mask, int connectivity) {
+        uint32_t total = connect(mask, connectivity);
+
+        // Labels in order of first run, and statistics in one pass over the runs
+        components.clear();
+        runLabel.resize(total);
+        for (const Strip& strip : strips)
+            for (size_t row = 0; row + 1 < strip.rowFirst.size(); row++) {
+                int y = strip.rowBegin + static_cast<int>(row);
+                for (uint32_t k = strip.rowFirst[row]; k < strip.rowFirst[row + 1]; k++) {
+                    uint32_t index = strip.firstRun + k;
+                    uint32_t root = find(parent, index);
+                    if (root == index) {
+                        components.push_back(ComponentStats());
+                        components.back().label = static_cast<uint32_t>(components.size());
+                        runLabel[index] = components.back().label;
+                    }
+                    else
+                        runLabel[index] = runLabel[root];
+
+                    const Run& run = strip.runs[k];
+                    ComponentStats& stats = components[runLabel[index] - 1];
+                    long long length = run.end - run.start;
+                    stats.area += length;
+                    stats.left = min(stats.left, run.start);
+                    stats.right = max(stats.right, run.end - 1);
+                    stats.top = min(stats.top, y);
+                    stats.bottom = y;
+                    stats.sumX += length * (run.start + run.end - 1) / 2;
+                    stats.sumY += length * y;
+                }
+            }
+        return components.size();
+    }
+
+    // Clears every component of mask that has no pixel set in seeds
+    void keepSeeded(BinaryMask& mask, const BinaryMask& seeds, int connectivity) {
+        uint32_t total = connect(mask, connectivity);
+        ThreadPool& pool = ThreadPool::instance();
+        vector<uint8_t> seeded(total);
+        pool.run(static_cast<int>(strips.size()), [&](int s) {
+            const Strip& strip = strips[s];
+            for (size_t row = 0; row + 1 < strip.rowFirst.size(); row++) {
+                const uint64_t* seedRow = seeds.row(strip.rowBegin + static_cast<int>(row));
+                for (uint32_t k = strip.rowFirst[row]; k < strip.rowFirst[row + 1]; k++)
+                    seeded[strip.firstRun + k] = BinaryMask::anyInRange(seedRow, strip.runs[k].start, strip.runs[k].end);
+            }
+        });
+
+        // runLabel holds the root of each run here
+        runLabel.resize(total);
+        for (uint32_t index = 0; index < total; index++) {
+            runLabel[index] = find(parent, index);
+            seeded[runLabel[index]] |= seeded[index];
+        }
+
+        pool.run(static_cast<int>(strips.size()), [&](int s) {
+            const Strip& strip = strips[s];
+            for (size_t row = 0; row + 1 < strip.rowFirst.size(); row++) {
+                uint64_t* bitsRow = mask.row(strip.rowBegin + static_cast<int>(row));
+                fill(bitsRow, bitsRow + mask.wordsPerRow, 0);
+                for (uint32_t k = strip.rowFirst[row]; k < strip.rowFirst[row + 1]; k++)
+                    if (seeded[runLabel[strip.firstRun + k]])
+                        BinaryMask::setRange(bitsRow, strip.runs[k].start, strip.runs[k].end);
+            }
+        });
+    }
+
+    // Label image at the depth for maxGray; labels above 65535 wrap to 1 again
+    PixelBuffer paint(int rows, int cols, int maxGray) const {
+        PixelBuffer labels;
+        labels.allocate(rows, cols, bytesForMaxGray(maxGray), true);
+        ThreadPool::instance().run(static_cast<int>(strips.size()), [&](int s) {
+            const Strip& strip = strips[s];
+            dispatchPixels(labels.bytesPerPixel, [&](auto zero) {
+                using T = decltype(zero);
+                for (size_t row = 0; row + 1 < strip.rowFirst.size(); row++) {
+                    T* out = labels.row<T>(strip.rowBegin + static_cast<int>(row));
+                    for (uint32_t k = strip.rowFirst[row]; k < strip.rowFirst[row + 1]; k++) {
+                        T value = static_cast<T>((runLabel[strip.firstRun + k] - 1) % 65535 + 1);
+                        fill(out + strip.runs[k].start, out + strip.runs[k].end, value);
+                    }
+                }
+            });
+        });
+        return labels;
+    }
+};
+
+// CANNY EDGES
+// Gaussian smoothing, the Sobel stage, non-maximum suppression and the double
+// threshold are fused over each band of rows: blurred row k is made from the
+// source rows around it, the gradient of row k from blurred rows k - 1..k + 1
+// and the edge class of row k from the gradients of rows k - 1..k + 1, so each
+// task keeps three rows of every intermediate. Pixels above the low threshold
+// and those above the high one go to two BinaryMasks; hysteresis keeps the
+// 8-connected components of the first that hold a pixel of the second.
+
+// Normalized Gaussian taps 0..radius with radius = ceil(3 sigma); sigma 0 is {1}
+vector<float> gaussianTaps(double sigma) {
+    int radius = static_cast<int>(ceil(3 * sigma));
+    vector<double> weights(radius + 1, 1.0);
+    double sum = 1;
+    for (int t = 1; t <= radius; t++) {
+        weights[t] = exp(-0.5 * t * t / (sigma * sigma));
+        sum += 2 * weights[t];
+    }
+    vector<float> taps(radius + 1);
+    for (int t = 0; t <= radius; t++)
+        taps[t] = static_cast<float>(weights[t] / sum);
+    return taps;
+}
+
+// Marks rows [rowBegin, rowEnd) of candidates (suppressed magnitude at least
+// low) and strong (at least high); thresholds are squared L2 magnitudes.
+template <typename T>
+void cannyRows(const PixelBuffer& src, const vector<float>& taps, long long lowSquared, long long highSquared,
+    int maxGray, BinaryMask& candidates, BinaryMask& strong, int rowBegin, int rowEnd) {
+    using Acc = SobelSum<T>;
+    // |Gx|, |Gy| <= 4 maxGray, so 8-bit squares fit 32 bits
+    using Magnitude = typename conditional<sizeof(T) == 1, int32_t, int64_t>::type;
+    int rows = src.rows, cols = src.cols;
+    int radius = static_cast<int>(taps.size()) - 1;
+
+    thread_local vector<float> column, sums;
+    thread_local vector<T> blurred;
+    thread_local vector<Acc> smooth, diff;
+    thread_local vector<Magnitude> magnitude, gradientX, gradientY;
+    column.assign(static_cast<size_t>(cols) + 2 * radius, 0.0f);
+    sums.resize(cols);
+    blurred.resize(3 * static_cast<size_t>(cols));
+    smooth.resize(cols);
+    diff.resize(cols);
+    magnitude.resize(3 * static_cast<size_t>(cols));
+    gradientX.resize(3 * static_cast<size_t>(cols));
+    gradientY.resize(3 * static_cast<size_t>(cols));
+
+    // Ring slot of row k
+    auto slot = [&](int k) { return static_cast<size_t>(k % 3) * cols; };
+
+    // Separable Gaussian with replicated borders, rounded back to T
+    auto blurRow = [&](int k) {
+        float* line = column.data() + radius;
+        const T* center = src.row<T>(k);
+        for (int j = 0; j < cols; j++)
+            line[j] = taps[0] * center[j];
+        for (int t = 1; t <= radius; t++) {
+            const T* above = src.row<T>(max(k - t, 0));
+            const T* below = src.row<T>(min(k + t, rows - 1));
+            float w = taps[t];
+            for (int j = 0; j < cols; j++)
+                line[j] += w * (static_cast<float>(above[j]) + static_cast<float>(below[j]));
+        }
+        for (int t = 1; t <= radius; t++) {
+            line[-t] = line[0];
+            line[cols - 1 + t] = line[cols - 1];
+        }
+        // Tap by tap over the whole row, so the inner loops vectorize
+        float* sum = sums.data();
+        for (int j = 0; j < cols; j++)
+            sum[j] = taps[0] * line[j];
+        for (int t = 1; t <= radius; t++) {
+            float w = taps[t];
+            for (int j = 0; j < cols; j++)
+                sum[j] += w * (line[j - t] + line[j + t]);
+        }
+        T* out = blurred.data() + slot(k);
+        for (int j = 0; j < cols; j++)
+            out[j] = clampPixel<T>(static_cast<int>(sum[j] + 0.5f), maxGray);
+    };
+
+    // Gx, Gy and squared magnitude of row k; 0 on the one-pixel border. The
+    // direction is only worked out for pixels that pass the low threshold.
+    auto gradientRow = [&](int k) {
+        Magnitude* m = magnitude.data() + slot(k);
+        Magnitude* gx = gradientX.data() + slot(k);
+        Magnitude* gy = gradientY.data() + slot(k);
+        fill(m, m + cols, 0);
+        if (k == 0 || k == rows - 1)
+            return;
+        sobelColumnPass<T>(blurred.data() + slot(k - 1), blurred.data() + slot(k), blurred.data() + slot(k + 1),
+            cols, smooth.data(), diff.data());
+        const Acc* s = smooth.data();
+        const Acc* d = diff.data();
+        for (int j = 1; j < cols - 1; j++) {
+            gx[j] = s[j + 1] - s[j - 1];
+            gy[j] = d[j - 1] + 2 * d[j] + d[j + 1];
+            m[j] = gx[j] * gx[j] + gy[j] * gy[j];
+        }
+    };
+
+    // Blurred rows first - 1..last + 1 feed gradient rows first..last
+    int first = max(rowBegin - 1, 0), last = min(rowEnd, rows - 1);
+    if (rows >= 3) {
+        blurRow(max(first - 1, 0));
+        if (first > 0)
+            blurRow(first);
+    }
+
+    for (int k = first; k <= last; k++) {
+        if (rows >= 3 && k + 1 < rows)
+            blurRow(k + 1);
+        gradientRow(k);
+
+        // Row i = k - 1 now has its gradient neighbours
+        int i = k - 1;
+        if (i < rowBegin || i < 1 || i >= rows - 1)
+            continue;
+        const Magnitude* up = magnitude.data() + slot(i - 1);
+        const Magnitude* mid = magnitude.data() + slot(i);
+        const Magnitude* down = magnitude.data() + slot(i + 1);
+        const Magnitude* gx = gradientX.data() + slot(i);
+        const Magnitude* gy = gradientY.data() + slot(i);
+        uint64_t* candidateRow = candidates.row(i);
+        uint64_t* strongRow = strong.row(i);
+
+        for (int j = 1; j < cols - 1; j++) {
+            Magnitude value = mid[j];
+            if (value < lowSquared || value == 0)
+                continue;
+            // Neighbours across the edge; ties go to the later one so a
+            // plateau still leaves a single pixel
+            Magnitude before, after;
+            switch (gradientSector(static_cast<int>(gx[j]), static_cast<int>(gy[j]))) {
+            case 0:
+                before = mid[j - 1];
+                after = mid[j + 1];
+                break;
+            case 1:
+                before = up[j - 1];
+                after = down[j + 1];
+                break;
+            case 2:
+                before = up[j];
+                after = down[j];
+                break;
+            default:
+                before = up[j + 1];
+                after = down[j - 1];
+                break;
+            }
+            if (value <= before || value < after)
+                continue;
+            candidateRow[j / 64] |= 1ULL << (j % 64);
+            if (value >= highSquared)
+                strongRow[j / 64] |= 1ULL << (j % 64);
+        }
+    }
+}
+
+// PYRAMID
+// Half-resolution copies of an image, built on demand and shared between
+// copies of the Image: level k is the 2 x 2 block mean of level k - 1, level 0
+// being the image itself (not stored here). Whoever changes the pixels clears it.
+struct ImagePyramid {
+    vector<shared_ptr<const PixelBuffer>> levels;    // levels[k - 1] is level k
+
+    void clear() {
+        levels.clear();
+    }
+
+    // Deepest level whose size is still at least ratio times the image, so
+    // resampling from it never enlarges
+    static int levelFor(double ratio, int rows, int cols) {
+        int level = 0;
+        while (ratio <= 0.5 / (1 << level) && (rows >> (level + 1)) > 0 && (cols >> (level + 1)) > 0 && level < 30)
+            level++;
+        return level;
+    }
+
+    const PixelBuffer& level(const PixelBuffer& base, int k) {
+        while (static_cast<int>(levels.size()) < k) {
+            const PixelBuffer& above = levels.empty() ? base : *levels.back();
+            auto reduced = make_shared<PixelBuffer>();
+            reduced->allocate(above.rows / 2, above.cols / 2, above.bytesPerPixel, false);
+            dispatchPixels(above.bytesPerPixel, [&](auto zero) {
+                using T = decltype(zero);
+                parallelRows(reduced->rows, static_cast<size_t>(reduced->cols) * sizeof(T), 0, [&](int rowBegin, int rowEnd) {
+                    areaDownscaleRows<T>(above, *reduced, 2, rowBegin, rowEnd);
+                });
+            });
+            levels.push_back(move(reduced));
+        }
+        return k == 0 ? base : *levels[k - 1];
+    }
+};
+
+// GEOMETRIC TRANSFORMS
+// Rotations, flips, translations and crops compose into one integer map from
+// output to source coordinates,
+//   source row = originRow + rowFromRow * r + rowFromCol * c
+//   source col = originCol + colFromRow * r + colFromCol * c
+// whose 2 x 2 part is a signed permutation. Output pixels outside the valid
+// rectangle [validTop, validBottom) x [validLeft, validRight) were shifted in
+// by a translation and are 0. Each step takes the output size before it.
+struct GeometricTransform {
+    bool identity = true;
+    int originRow = 0, originCol = 0;
+    int rowFromRow = 1, rowFromCol = 0, colFromRow = 0, colFromCol = 1;
+    int validTop = 0, validLeft = 0, validBottom = 0, validRight = 0;
+
+    void reset(int rows, int cols) {
+        *this = GeometricTransform();
+        validBottom = rows;
+        validRight = cols;
+    }
+
+    // The new output (r, c) reads the old output (a0 + a1 r + a2 c, b0 + b1 r + b2 c)
+    void compose(int a0, int a1, int a2, int b0, int b1, int b2) {
+        GeometricTransform old = *this;
+        originRow = old.originRow + old.rowFromRow * a0 + old.rowFromCol * b0;
+        originCol = old.originCol + old.colFromRow * a0 + old.colFromCol * b0;
+        rowFromRow = old.rowFromRow * a1 + old.rowFromCol * b1;
+        rowFromCol = old.rowFromRow * a2 + old.rowFromCol * b2;
+        colFromRow = old.colFromRow * a1 + old.colFromCol * b1;
+        colFromCol = old.colFromRow * a2 + old.colFromCol * b2;
+        identity = false;
+    }
+
+    void setValid(int top, int left, int bottom, int right, int rows, int cols) {
+        validTop = max(top, 0);
+        validLeft = max(left, 0);
+        validBottom = max(validTop, min(bottom, rows));
+        validRight = max(validLeft, min(right, cols));
+    }
+
+    void rotateClockwise(int rows, int cols) {
+        compose(rows - 1, 0, -1, 0, 1, 0);
+        setValid(validLeft, rows - validBottom, validRight, rows - validTop, cols, rows);
+    }
+
+    void rotateCounterClockwise(int rows, int cols) {
+        compose(0, 0, 1, cols - 1, -1, 0);
+        setValid(cols - validRight, validTop, cols - validLeft, validBottom, cols, rows);
+    }
+
+    void flipVertical(int rows, int cols) {
+        compose(rows - 1, -1, 0, 0, 0, 1);
+        setValid(rows - validBottom, validLeft, rows - validTop, validRight, rows, cols);
+    }
+
+    void flipHorizontal(int rows, int cols) {
+        compose(0, 1, 0, cols - 1, 0, -1);
+        setValid(validTop, cols - validRight, validBottom, cols - validLeft, rows, cols);
+    }
+
+    void translate(int deltaX, int deltaY, int rows, int cols) {
+        compose(-deltaY, 1, 0, -deltaX, 0, 1);
+        setValid(validTop + deltaY, validLeft + deltaX, validBottom + deltaY, validRight + deltaX, rows, cols);
+    }
+
+    void crop(int top, int left, int newRows, int newCols) {
+        compose(top, 1, 0, left, 0, 1);
+        setValid(validTop - top, validLeft - left, validBottom - top, validRight - left, newRows, newCols);
+    }
+
+    // Renders src through the map into a rows x cols buffer. Only the source
+    // pixels that land in the valid rectangle are read: straight rows are
+    // copied (and mirrored when the columns run backwards), transposed ones go
+    // through the blocked transpose.
+    PixelBuffer render(const PixelBuffer& src, int rows, int cols) const {
+        PixelBuffer out;
+        bool full = validTop == 0 && validLeft == 0 && validBottom == rows && validRight == cols;
+        out.allocate(rows, cols, src.bytesPerPixel, !full);
+
+        int height = validBottom - validTop, width = validRight - validLeft;
+        if (height <= 0 || width <= 0)
+            return out;
+
+        dispatchPixels(src.bytesPerPixel, [&](auto zero) {
+            using T = decltype(zero);
+            if (rowFromCol == 0) {
+                // Source column of the leftmost output pixel that is read first in memory
+                int firstCol = originCol + colFromCol * (colFromCol > 0 ? validLeft : validRight - 1);
+                parallelRows(height, static_cast<size_t>(width) * sizeof(T), 0, [&](int rowBegin, int rowEnd) {
+                    for (int j = rowBegin; j < rowEnd; j++) {
+                        int r = validTop + j;
+                        T* result = out.row<T>(r) + validLeft;
+                        memcpy(result, src.row<T>(originRow + rowFromRow * r) + firstCol, static_cast<size_t>(width) * sizeof(T));
+                        if (colFromCol < 0)
+                            reverseRow(result, width);
+                    }
+                });
+            }
+            else {
+                // out(r, c) = src(originRow + rowFromCol c, originCol + colFromRow r);
+                // output rows are listed in the order their source column increases
+                vector<const T*> srcRows(width);
+                vector<T*> outRows(height);
+                int firstCol = originCol + colFromRow * (colFromRow > 0 ? validTop : validBottom - 1);
+                for (int i = 0; i < width; i++)
+                    srcRows[i] = src.row<T>(originRow + rowFromCol * (validLeft + i)) + firstCol;
+                for (int j = 0; j < height; j++)
+                    outRows[j] = out.row<T>(colFromRow > 0 ? validTop + j : validBottom - 1 - j) + validLeft;
+                transposeRows<T>(srcRows, outRows, height);
+            }
+        });
+        return out;
+    }
+};
+
+// MOSAIC
+// Grid of cells filled row by row, gridCols to a row. Each grid column is as
+// wide as its widest cell and each grid row as tall as its tallest, with
+// padding pixels around and between cells; cells sit top-left in their slot
+// and uncovered pixels take the background value. Output rows are assembled
+// with one memcpy per cell (cells of a smaller depth are widened pixel by
+// pixel), either into one buffer or band by band straight into a file.
+struct Mosaic {
+    vector<const PixelBuffer*> cells;
+    int gridCols = 1, padding = 0, background = 0, maxGray = 0;
+    int rows = 0, cols = 0, bytesPerPixel = 1;
+    vector<int> columnLeft, rowTop;
+
+    // Returns false if the layout is invalid or the result would be too large
+    bool layout() {
+        if (cells.empty() || gridCols < 1 || padding < 0 || background < 0 || background > maxGray)
+            return false;
+        gridCols = min(gridCols, static_cast<int>(cells.size()));
+        int gridRows = (static_cast<int>(cells.size()) + gridCols - 1) / gridCols;
+
+        vector<int> widths(gridCols, 0), heights(gridRows, 0);
+        for (size_t k = 0; k < cells.size(); k++) {
+            widths[k % gridCols] = max(widths[k % gridCols], cells[k]->cols);
+            heights[k / gridCols] = max(heights[k / gridCols], cells[k]->rows);
+        }
+
+        long long width = padding, height = padding;
+        columnLeft.assign(gridCols, 0);
+        rowTop.assign(gridRows, 0);
+        for (int c = 0; c < gridCols; c++) {
+            columnLeft[c] = static_cast<int>(min<long long>(width, INT_MAX));
+            width += static_cast<long long>(widths[c]) + padding;
+        }
+        for (int r = 0; r < gridRows; r++) {
+            rowTop[r] = static_cast<int>(min<long long>(height, INT_MAX));
+            height += static_cast<long long>(heights[r]) + padding;
+        }
+        if (width > INT_MAX || height > INT_MAX || width * height > (1LL << 40))
+            return false;
+
+        cols = static_cast<int>(width);
+        rows = static_cast<int>(height);
+        bytesPerPixel = bytesForMaxGray(maxGray);
+        return true;
+    }
+
+    // Writes mosaic rows [rowBegin, rowEnd) to out, whose row 0 is mosaic row firstRow
+    void renderRows(PixelBuffer& out, int firstRow, int rowBegin, int rowEnd) const {
+        dispatchPixels(bytesPerPixel, [&](auto zero) {
+            using T = decltype(zero);
+            T fillValue = static_cast<T>(background);
+
+            for (int y = rowBegin; y < rowEnd; y++) {
+                T* dst = out.row<T>(y - firstRow);
+                int gridRow = static_cast<int>(upper_bound(rowTop.begin(), rowTop.end(), y) - rowTop.begin()) - 1;
+                int x = 0;
+
+                for (int c = 0; gridRow >= 0 && c < gridCols; c++) {
+                    size_t k = static_cast<size_t>(gridRow) * gridCols + c;
+                    if (k >= cells.size())
+                        break;
+                    const PixelBuffer& cell = *cells[k];
+                    int cellY = y - rowTop[gridRow];
+                    if (cellY >= cell.rows || cell.cols == 0)
+                        continue;
+
+                    fill(dst + x, dst + columnLeft[c], fillValue);
+                    T* cellDst = dst + columnLeft[c];
+                    if (cell.bytesPerPixel == static_cast<int>(sizeof(T)))
+                        memcpy(cellDst, cell.row<T>(cellY), static_cast<size_t>(cell.cols) * sizeof(T));
+                    else {
+                        const unsigned char* src = cell.row<unsigned char>(cellY);
+                        for (int j = 0; j < cell.cols; j++)
+                            cellDst[j] = src[j];
+                    }
+                    x = columnLeft[c] + cell.cols;
+                }
+                fill(dst + x, dst + cols, fillValue);
+            }
+        });
+    }
+
+    PixelBuffer render() const {
+        PixelBuffer out;
+        out.allocate(rows, cols, bytesPerPixel, false);
+        parallelRows(rows, static_cast<size_t>(cols) * bytesPerPixel, 0, [&](int rowBegin, int rowEnd) {
+            renderRows(out, 0, rowBegin, rowEnd);
+        });
+        return out;
+    }
+
+    // Streams the mosaic to out as P5 or P2 through a band of about 4 MB, so
+    // the whole mosaic is never held in memory
+    bool write(FileWriter& out, bool p5) const {
+        char header[64];
+        int headerLength = formatPGMHeader(header, sizeof(header), p5 ? "P5" : "P2", cols, rows, maxGray);
+        size_t rowBytes = static_cast<size_t>(cols) * bytesPerPixel;
+        int bandRows = static_cast<int>(max<size_t>(1, (static_cast<size_t>(1) << 22) / max<size_t>(rowBytes, 1)));
+
+        PixelBuffer band;
+        for (int r = 0; r < rows; r += bandRows) {
+            int count = min(bandRows, rows - r);
+            if (band.rows != count)
+                band.allocate(count, cols, bytesPerPixel, false);
+            parallelRows(count, rowBytes, 0, [&](int rowBegin, int rowEnd) {
+                renderRows(band, r, r + rowBegin, r + rowEnd);
+            });
+            const char* bandHeader = r == 0 ? header : "";
+            bool written = p5 ? writeP5Rows(out, band, bandHeader, r == 0 ? headerLength : 0) : writeP2Rows(out, band, bandHeader);
+            if (!written)
+                return false;
+        }
+        return true;
+    }
+};
+
+// Image state kept for undo and redo. The pixels share tiles with the image,
+// so taking one costs a pointer per tile.
+struct ImageSnapshot {
+    PixelBuffer pixels;
+    BinaryMask mask;
+    GeometricTransform transform;
+    int rows = 0, cols = 0, maxGray = 255;
+};
+
 struct Image {
-    char ImageFileName[100];
-    vector<vector<int>> ImageData;
-    int cols, rows, maxGray;
+    char ImageFileName[100] = "";
+    PixelBuffer ImageData;
+    int cols = 0, rows = 0, maxGray = 255;
+    char MagicNumber[3] = "P2";
     vector<char> comment;
 
-    bool imageLoaded;
-    bool imageModified;
+    bool imageLoaded = false;
+    bool imageModified = false;
+
+    // Rotations, flips, translations and crops only update this and the size;
+    // materialize() applies them in one pass before pixels are read
+    GeometricTransform pendingTransform;
+
+    // After convertToBinary(threshold, true) the pixels are held here, one bit
+    // each, and ImageData is empty until materialize() unpacks them
+    BinaryMask mask;
+
+    // Half-resolution levels for repeated downscaling; scaleImage and
+    // resizeImage use them only when usePyramid is set (pipeline step
+    // "pyramid on"), scaledCopy always
+    ImagePyramid pyramid;
+    bool usePyramid = false;
+
+    // Every editing method records the state before it; undoLimit 0 turns
+    // the history off
+    vector<ImageSnapshot> undoHistory, redoHistory;
+    size_t undoLimit = 16;
+
+    // Messages go to cout only when verbose (the interactive menu). Errors are
+    // also kept in lastError so headless callers can report them.
+    bool verbose = true;
+    string lastError;
+
+    void reportError(const char* message) {
+        lastError = message;
+        if (verbose)
+            cout << message << endl;
+    }
 
-    // LOAD IMAGE
-    int loadImage(char ImageName[]) {
+    // Every change to the pixels goes through here so the pyramid is dropped
+    void markModified() {
+        imageModified = true;
+        pyramid.clear();
+    }
 
-        ifstream FCIN(ImageName);
+    ImageSnapshot snapshot() const {
+        ImageSnapshot state;
+        state.pixels = ImageData;
+        state.mask = mask;
+        state.transform = pendingTransform;
+        state.rows = rows;
+        state.cols = cols;
+        state.maxGray = maxGray;
+        return state;
+    }
 
-        if (!FCIN.is_open())
-            return -1;
+    void restore(ImageSnapshot& state) {
+        ImageData = move(state.pixels);
+        mask = move(state.mask);
+        pendingTransform = state.transform;
+        rows = state.rows;
+        cols = state.cols;
+        maxGray = state.maxGray;
+        markModified();
+    }
+
+    void recordUndo() {
+        if (undoLimit == 0)
+            return;
+        if (undoHistory.size() >= undoLimit)
+            undoHistory.erase(undoHistory.begin());
+        undoHistory.push_back(snapshot());
+        redoHistory.clear();
+    }
+
+    // Function to Undo the Last Edit
+    bool undo() {
+        if (undoHistory.empty()) {
+            reportError("Error: Nothing to undo.");
+            return false;
+        }
+
+        redoHistory.push_back(snapshot());
+        restore(undoHistory.back());
+        undoHistory.pop_back();
+
+        if (verbose)
+            cout << "Last edit undone." << endl;
+        return true;
+    }
+
+    // Function to Redo an Undone Edit
+    bool redo() {
+        if (redoHistory.empty()) {
+            reportError("Error: Nothing to redo.");
+            return false;
+        }
+
+        undoHistory.push_back(snapshot());
+        restore(redoHistory.back());
+        redoHistory.pop_back();
+
+        if (verbose)
+            cout << "Edit redone." << endl;
+        return true;
+    }
+
+    size_t rowBytes() const {
+        return static_cast<size_t>(cols) * ImageData.bytesPerPixel;
+    }
 
-        char MagicNumber[5];
-        char Comment[100];
+    void materialize() {
+        if (!mask.empty()) {
+            ProfileScope scope("unpack-mask", "render", static_cast<long long>(mask.rows) * mask.cols);
+            ImageData = mask.unpack(maxGray);
+            mask.clear();
+        }
+        if (pendingTransform.identity)
+            return;
+        ProfileScope scope("transform", "render", static_cast<long long>(rows) * cols);
+        ImageData = pendingTransform.render(ImageData, rows, cols);
+        pendingTransform.reset(rows, cols);
+    }
+
+    // Pixels with the pending transform applied, for images that must stay
+    // const; rendered into scratch only when a transform is pending
+    const PixelBuffer& currentPixels(PixelBuffer& scratch) const {
+        if (!mask.empty()) {
+            scratch = mask.unpack(maxGray);
+            if (!pendingTransform.identity)
+                scratch = pendingTransform.render(scratch, rows, cols);
+            return scratch;
+        }
+        if (pendingTransform.identity)
+            return ImageData;
+        scratch = pendingTransform.render(ImageData, rows, cols);
+        return scratch;
+    }
+
+    // LOAD IMAGE
+    int loadImage(const char ImageName[]) {
+        ProfileScope scope("load", "parse");
 
-        FCIN.getline(MagicNumber, 4);
-        FCIN.getline(Comment, 100);
-        FCIN >> cols >> rows >> maxGray;
+        MappedFile file;
 
-        ImageData.clear();
-        ImageData.resize(rows, vector<int>(cols, 0));
+        if (file.open(ImageName) != 0)
+            return -1;
 
-        for (int r = 0; r < rows; r++)
-            for (int c = 0; c < cols; c++)
-                FCIN >> ImageData[r][c];
+        PGMHeader header;
+        if (parsePGMHeader(file.data, file.size, header) != 0)
+            return -2;
 
-        if (FCIN.fail())
+        PixelBuffer loaded;
+        if (strcmp(header.magic, "P2") == 0) {
+            loaded.allocate(header.rows, header.cols, bytesForMaxGray(header.maxGray), false);
+            if (!parseP2Pixels(file.data + header.dataOffset, file.data + file.size, loaded, header.maxGray))
+                return -2;
+        }
+        else if (strcmp(header.magic, "P5") == 0) {
+            if (!loadP5Pixels(file, header, loaded))
+                return -2;
+        }
+        else
             return -2;
 
-        FCIN.close();
+        scope.pixels = static_cast<long long>(header.rows) * header.cols;
+        ImageData = move(loaded);
+        strcpy(MagicNumber, header.magic);
+        cols = header.cols;
+        rows = header.rows;
+        maxGray = header.maxGray;
+        pendingTransform.reset(rows, cols);
+        mask.clear();
+        pyramid.clear();
+        undoHistory.clear();
+        redoHistory.clear();
         imageLoaded = true;
         imageModified = false;
-        strcpy(ImageFileName, ImageName);
+        snprintf(ImageFileName, sizeof(ImageFileName), "%s", ImageName);
         return 0;
     }
 
     // SAVE IMAGE
-    int saveImage(char ImageName[]) {
-        ofstream FCOUT(ImageName);
-        if (!FCOUT.is_open())
+    // Files are written in the format they were loaded in (P2 or P5). A file
+    // name of "-" writes to standard output so results can be piped onwards.
+    int saveImage(const char ImageName[]) {
+        FileWriter out;
+        if (strcmp(ImageName, "-") == 0) {
+            cout.flush();
+            out.attach(1);
+        }
+        else if (out.open(ImageName) != 0)
             return -1;
 
-        FCOUT << "P2\n# This is a comment\n"
-            << cols << " " << rows << endl << maxGray << endl;
-        for (int r = 0; r < rows; r++) {
-            for (int c = 0; c < cols; c++)
-                FCOUT << ImageData[r][c] << " ";
-            FCOUT << endl;
-        }
-        FCOUT.close();
+        return writeImage(out);
+    }
+
+    // Saves to an already open file descriptor, which is left open
+    int saveImageToFd(int fd) {
+        FileWriter out;
+        out.attach(fd);
+        return writeImage(out);
+    }
+
+    // A packed mask is unpacked into scratch for the write and stays packed
+    int writeImage(FileWriter& out) {
+        if (mask.empty())
+            materialize();
+        PixelBuffer scratch;
+        const PixelBuffer& pixels = currentPixels(scratch);
+        ProfileScope scope(strcmp(MagicNumber, "P5") == 0 ? "save-p5" : "save-p2", "write", static_cast<long long>(rows) * cols);
+        bool written = strcmp(MagicNumber, "P5") == 0 ? writeP5(out, pixels, maxGray) : writeP2(out, pixels, maxGray);
+        if (!written || out.close() != 0)
+            return -2;
+
         imageModified = false;
         return 0;
     }
 
 
+    // Applies a run of point operations as one composed lookup table. Every
+    // operation is monotonic, so the range a contrast stretch needs is the
+    // source range pushed through the table built so far; only one min/max
+    // scan and one write pass touch the pixels.
+    void applyPointOperations(const vector<PointOperation>& operations) {
+        recordUndo();
+        materialize();
+        pyramid.clear();
+        ProfileScope scope("point", "compute", static_cast<long long>(rows) * cols);
+        PointLUT lut(ImageData.bytesPerPixel);
+        int minPixelValue = 0, maxPixelValue = 0;
+        bool rangeKnown = false;
+
+        for (const PointOperation& operation : operations) {
+            if (operation.kind == PointOperation::Brightness)
+                lut.addBrightness(operation.value, maxGray);
+            else if (operation.kind == PointOperation::Threshold)
+                lut.addThreshold(static_cast<int>(operation.value), maxGray);
+            else {
+                if (!rangeKnown) {
+                    pixelRange(ImageData, minPixelValue, maxPixelValue);
+                    rangeKnown = true;
+                }
+                if (minPixelValue > maxPixelValue)
+                    continue;
+                int low = lut.table[minPixelValue], high = lut.table[maxPixelValue];
+                // A flat image has no range to stretch
+                if (high > low)
+                    lut.addContrastStretch(low, high, maxGray);
+            }
+        }
+
+        lut.apply(ImageData);
+    }
+
     // Function to Adjust Brightness
     void changeBrightness(double factor) {
-        for (int r = 0; r < rows; r++)
-            for (int c = 0; c < cols; c++) {
-                ImageData[r][c] *= factor;
-                if (ImageData[r][c] > maxGray)
-                    ImageData[r][c] = maxGray;
-            }
+        applyPointOperations({ { PointOperation::Brightness, factor } });
     }
 
     // Function to Adjust Contrast
     void contrastStretching() {
         if (!imageLoaded) {
-            cout << "Error: Image not loaded." << endl;
+            reportError("Error: Image not loaded.");
             return;
         }
-        int minPixelValue = INT_MAX;
-        int maxPixelValue = INT_MIN;
-
-        for (int r = 0; r < rows; ++r) {
-            for (int c = 0; c < cols; ++c) {
-                int pixelValue = ImageData[r][c];
-                minPixelValue = min(minPixelValue, pixelValue);
-                maxPixelValue = max(maxPixelValue, pixelValue);
-            }
-        }
-        double factor = 255.0 / (maxPixelValue - minPixelValue);
-
-        for (int r = 0; r < rows; ++r) {
-            for (int c = 0; c < cols; ++c) {
 
-                ImageData[r][c] = static_cast<int>((ImageData[r][c] - minPixelValue) * factor);
-            }
-        }
+        applyPointOperations({ { PointOperation::ContrastStretch, 0 } });
 
-        cout << "Contrast stretching applied." << endl;
-        imageModified = true;
+        if (verbose)
+            cout << "Contrast stretching applied." << endl;
+        markModified();
     }
 
     // Function to Adjust Sharpness
     void applySharpening() {
         if (!imageLoaded) {
-            cout << "Error: Image not loaded." << endl;
+            reportError("Error: Image not loaded.");
             return;
         }
 
-        vector<vector<double>> sharpeningKernel = {
-            {-1, -1, -1},
-            {-1, 9, -1},
-            {-1, -1, -1}
-        };
+        recordUndo();
+        materialize();
+        ProfileScope scope("sharpen", "compute", static_cast<long long>(rows) * cols);
+
+        // Kernel: 9 at the center, -1 for the eight neighbours; borders stay 0
+        PixelBuffer sharpened;
+        sharpened.allocate(rows, cols, ImageData.bytesPerPixel);
+
+        const PixelBuffer& source = ImageData;
+        dispatchPixels(source.bytesPerPixel, [&](auto zero) {
+            using T = decltype(zero);
+            parallelRows(rows, rowBytes(), 1, [&](int rowBegin, int rowEnd) {
+                for (int i = max(rowBegin, 1); i < min(rowEnd, rows - 1); ++i) {
+                    const T* up = source.row<T>(i - 1);
+                    const T* mid = source.row<T>(i);
+                    const T* down = source.row<T>(i + 1);
+                    T* out = sharpened.row<T>(i);
+
+                    for (int j = 1; j < cols - 1; ++j) {
+                        int neighbours = up[j - 1] + up[j] + up[j + 1]
+                            + mid[j - 1] + mid[j + 1]
+                            + down[j - 1] + down[j] + down[j + 1];
+                        out[j] = clampPixel<T>(9 * mid[j] - neighbours, maxGray);
+                    }
+                }
+            });
+        });
 
-        vector<vector<double>> newImageData(rows, vector<double>(cols, 0.0));
+        ImageData = move(sharpened);
 
-        for (int i = 1; i < rows - 1; ++i) {
-            for (int j = 1; j < cols - 1; ++j) {
-                double sum = 0.0;
+        if (verbose)
+            cout << "Sharpness adjustment applied." << endl;
+        markModified();
+    }
 
-                for (int m = -1; m <= 1; ++m) {
-                    for (int n = -1; n <= 1; ++n) {
-                        sum += sharpeningKernel[m + 1][n + 1] * static_cast<double>(ImageData[i + m][j + n]);
-                    }
-                }
-                newImageData[i][j] = sum;
-            }
+    // Function to Convert Image to Binary
+    // Pixels at or above threshold become maxGray and the rest 0. With packed
+    // the result is kept as a 1-bit mask, which the morphology operations need.
+    void convertToBinary(int threshold, bool packed = false) {
+        if (!imageLoaded) {
+            reportError("Error: Image not loaded.");
+            return;
         }
-        for (int i = 0; i < rows; ++i) {
-            for (int j = 0; j < cols; ++j) {
-                ImageData[i][j] = static_cast<int>(std::min(255.0, std::max(0.0, newImageData[i][j])));
-            }
+
+        if (packed) {
+            recordUndo();
+            materialize();
+            ProfileScope scope("pack-mask", "compute", static_cast<long long>(rows) * cols);
+            mask.pack(ImageData, threshold);
+            ImageData = PixelBuffer();
         }
+        else
+            applyPointOperations({ { PointOperation::Threshold, static_cast<double>(threshold) } });
 
-        cout << "Sharpness adjustment applied." << endl;
-        imageModified = true;
+        if (verbose)
+            cout << (packed ? "Image converted to a packed binary mask." : "Image converted to binary.") << endl;
+        markModified();
     }
 
-    // Function to Convert Image to Binary
-    void convertToBinary(int threshold) {
+    // Function to Label Connected Components
+    // Pixels that are not 0 (the set pixels of a packed mask) form components.
+    // The image becomes the label map: 0 for the background, components
+    // numbered in raster order of their first pixel and maxGray the count
+    // (labels past 65535 wrap around to 1). Returns the count, or -1; stats
+    // receives one entry per label when given.
+    long long labelComponents(int connectivity = 8, vector<ComponentStats>* stats = nullptr) {
         if (!imageLoaded) {
-            cout << "Error: Image not loaded." << endl;
-            return;
+            reportError("Error: Image not loaded.");
+            return -1;
         }
 
-        for (int i = 0; i < rows; ++i) {
-            for (int j = 0; j < cols; ++j) {
-                ImageData[i][j] = (ImageData[i][j] < threshold) ? 0 : maxGray;
-            }
+        if (connectivity != 4 && connectivity != 8) {
+            reportError("Error: Connectivity must be 4 or 8.");
+            return -1;
         }
 
-        cout << "Image converted to binary." << endl;
-        imageModified = true;
+        recordUndo();
+        if (mask.empty() || !pendingTransform.identity) {
+            materialize();
+            mask.pack(ImageData, 1);
+        }
+
+        ProfileScope scope("label", "compute", static_cast<long long>(rows) * cols);
+        ComponentLabeling labeling;
+        size_t count = labeling.label(mask, connectivity);
+        maxGray = static_cast<int>(max<size_t>(1, min<size_t>(count, 65535)));
+        ImageData = labeling.paint(rows, cols, maxGray);
+        mask.clear();
+        if (stats != nullptr)
+            *stats = move(labeling.components);
+
+        if (verbose)
+            cout << count << " connected components labeled." << endl;
+        markModified();
+        return static_cast<long long>(count);
     }
 
-    // Function to Resize Image
-    void resizeImage(double ratio) {
+    // Function to Erode, Dilate, Open or Close a Binary Mask
+    // The structuring element is a width x height rectangle or cross centred on
+    // each pixel. A rotation or other pending transform is applied first.
+    void applyMorphology(MorphologyOperation operation, MorphologyShape shape, int width, int height) {
         if (!imageLoaded) {
-            cout << "Error: Image not loaded." << endl;
+            reportError("Error: Image not loaded.");
             return;
         }
 
-        int newRows = static_cast<int>(rows * ratio);
-        int newCols = static_cast<int>(cols * ratio);
+        if (mask.empty()) {
+            reportError("Error: Morphology needs a packed binary mask (convert to binary with packing first).");
+            return;
+        }
 
-        vector<vector<int>> resizedImageData(newRows, vector<int>(newCols, 0));
+        if (width < 1 || height < 1 || width > 65535 || height > 65535) {
+            reportError("Error: Structuring element size must be between 1 and 65535.");
+            return;
+        }
 
-        for (int i = 0; i < newRows; ++i) {
-            for (int j = 0; j < newCols; ++j) {
-                int originalRow = static_cast<int>(i / ratio);
-                int originalCol = static_cast<int>(j / ratio);
-                resizedImageData[i][j] = ImageData[originalRow][originalCol];
-            }
+        recordUndo();
+        if (!pendingTransform.identity) {
+            // The unpacked pixels are exactly 0 or maxGray
+            materialize();
+            mask.pack(ImageData, max(maxGray, 1));
+            ImageData = PixelBuffer();
         }
 
-        ImageData = resizedImageData;
+        ProfileScope scope("morphology", "compute", static_cast<long long>(rows) * cols);
+        mask.apply(operation, shape, width, height);
+
+        if (verbose)
+            cout << "Morphology applied." << endl;
+        markModified();
+    }
+
+    // Resampling shared by resizeImage and scaleImage. With usePyramid set,
+    // downscales start from the smallest pyramid level that is still larger
+    // than the result.
+    void resample(double ratio, ResampleFilter filter) {
+        recordUndo();
+        materialize();
+        ProfileScope scope("resample", "compute", static_cast<long long>(rows) * cols);
+        // int(size * ratio), but never an empty image
+        int newRows = max(1, static_cast<int>(rows * ratio));
+        int newCols = max(1, static_cast<int>(cols * ratio));
+
+        if (filter == ResampleNearest)
+            ImageData = resampleNearestPixels(ImageData, newRows, newCols, ratio);
+        else {
+            int level = usePyramid ? ImagePyramid::levelFor(ratio, rows, cols) : 0;
+            const PixelBuffer& source = pyramid.level(ImageData, level);
+            ImageData = resamplePixels(source, newRows, newCols, 1.0 / (ratio * (1 << level)), filter, maxGray);
+        }
         rows = newRows;
         cols = newCols;
+        pendingTransform.reset(rows, cols);
+    }
 
-        cout << "Image resized to " << newCols << "x" << newRows << "." << endl;
-        imageModified = true;
+    // Returns a copy scaled by factor, leaving this image as it is. The copy is
+    // resampled from the pyramid, which stays built for the next call, so a
+    // series of thumbnails costs little more than the smallest of them.
+    Image scaledCopy(double factor, ResampleFilter filter = ResampleAuto) {
+        materialize();
+        ProfileScope scope("scaled-copy", "compute", static_cast<long long>(rows) * cols);
+        Image scaled;
+        strcpy(scaled.ImageFileName, ImageFileName);
+        strcpy(scaled.MagicNumber, MagicNumber);
+        scaled.comment = comment;
+        scaled.maxGray = maxGray;
+        scaled.verbose = verbose;
+        scaled.rows = max(1, static_cast<int>(rows * factor));
+        scaled.cols = max(1, static_cast<int>(cols * factor));
+        scaled.pendingTransform.reset(scaled.rows, scaled.cols);
+        scaled.imageLoaded = true;
+
+        if (filter == ResampleNearest)
+            scaled.ImageData = resampleNearestPixels(ImageData, scaled.rows, scaled.cols, factor);
+        else {
+            int level = ImagePyramid::levelFor(factor, rows, cols);
+            scaled.ImageData = resamplePixels(pyramid.level(ImageData, level), scaled.rows, scaled.cols,
+                1.0 / (factor * (1 << level)), filter, maxGray);
+        }
+        return scaled;
+    }
+
+    // Function to Resize Image
+    void resizeImage(double ratio, ResampleFilter filter = ResampleAuto) {
+        if (!imageLoaded) {
+            reportError("Error: Image not loaded.");
+            return;
+        }
+
+        if (ratio <= 0) {
+            reportError("Error: Invalid resizing ratio.");
+            return;
+        }
+
+        resample(ratio, filter);
+
+        if (verbose)
+            cout << "Image resized to " << cols << "x" << rows << "." << endl;
+        markModified();
     }
 
     // Function to Rotate Image Clockwise
     void rotate90Clockwise() {
         if (!imageLoaded) {
-            cout << "Error: Image not loaded." << endl;
+            reportError("Error: Image not loaded.");
+            return;
+        }
+
+        recordUndo();
+        pendingTransform.rotateClockwise(rows, cols);
+        swap(rows, cols);
+
+        if (verbose)
+            cout << "Image rotated 90 degrees clockwise." << endl;
+        markModified();
+    }
+
+    // Function to Rotate CounterClockwise
+    void rotate90CounterClockwise() {
+        if (!imageLoaded) {
+            reportError("Error: Image not loaded.");
+            return;
+        }
+
+        recordUndo();
+        pendingTransform.rotateCounterClockwise(rows, cols);
+        swap(rows, cols);
+
+        if (verbose)
+            cout << "Image rotated 90 degrees counterclockwise." << endl;
+        markModified();
+    }
+
+    // Function to Flip image Vertically
+    void flipVertical() {
+        if (!imageLoaded) {
+            reportError("Error: Image not loaded.");
+            return;
+        }
+
+        recordUndo();
+        pendingTransform.flipVertical(rows, cols);
+
+        if (verbose)
+            cout << "Image flipped vertically." << endl;
+        markModified();
+    }
+
+    // Funtion to Flip image Horizontally
+    void horzontalFlipImage() {
+        recordUndo();
+        pendingTransform.flipHorizontal(rows, cols);
+        pyramid.clear();
+        return;
+    }
+
+    // Function to Translate Image
+    // Pixels shifted in from outside the image are 0
+    void translateImage(int deltaX, int deltaY) {
+        if (!imageLoaded) {
+            reportError("Error: Image not loaded.");
+            return;
+        }
+
+        recordUndo();
+        pendingTransform.translate(deltaX, deltaY, rows, cols);
+
+        if (verbose)
+            cout << "Image translated by (" << deltaX << ", " << deltaY << ")." << endl;
+        markModified();
+    }
+
+    // Function to Scale Image
+    void scaleImage(double scaleFactor, ResampleFilter filter = ResampleAuto) {
+        if (!imageLoaded) {
+            reportError("Error: Image not loaded.");
+            return;
+        }
+
+        if (scaleFactor <= 0) {
+            reportError("Error: Invalid scaling factor.");
+            return;
+        }
+
+        resample(scaleFactor, filter);
+
+        if (verbose)
+            cout << "Image scaled by a factor of " << scaleFactor << "." << endl;
+        markModified();
+    }
+
+    // Function to Crop Image
+    void cropImage(int startX, int startY, int endX, int endY) {
+        if (!imageLoaded) {
+            reportError("Error: Image not loaded.");
+            return;
+        }
+
+        if (startX < 0 || startY < 0 || endX >= cols || endY >= rows || startX >= endX || startY >= endY) {
+            reportError("Invalid crop coordinates.");
+            return;
+        }
+
+        int newRows = endY - startY + 1;
+        int newCols = endX - startX + 1;
+
+        recordUndo();
+        pendingTransform.crop(startY, startX, newRows, newCols);
+        rows = newRows;
+        cols = newCols;
+
+        if (verbose)
+            cout << "Image cropped." << endl;
+        markModified();
+    }
+
+    // Lays this image and others out with a Mosaic and makes the result this
+    // image, at the widest depth among them. Returns false for an invalid layout.
+    bool arrangeGrid(const vector<const Image*>& others, int gridCols, int padding, int background) {
+        Mosaic mosaic;
+        mosaic.gridCols = gridCols;
+        mosaic.padding = padding;
+        mosaic.background = background;
+        mosaic.maxGray = maxGray;
+
+        // Cells are read through currentPixels so nothing changes (and no undo
+        // step is recorded) until the layout is known to be valid
+        vector<PixelBuffer> rendered(others.size() + 1);
+        mosaic.cells.push_back(&currentPixels(rendered[0]));
+        for (size_t k = 0; k < others.size(); k++) {
+            mosaic.cells.push_back(&others[k]->currentPixels(rendered[k + 1]));
+            mosaic.maxGray = max(mosaic.maxGray, others[k]->maxGray);
+        }
+        if (!mosaic.layout())
+            return false;
+
+        recordUndo();
+        ProfileScope scope("mosaic", "compute", static_cast<long long>(mosaic.rows) * mosaic.cols);
+        ImageData = mosaic.render();
+        mask.clear();
+        rows = mosaic.rows;
+        cols = mosaic.cols;
+        maxGray = mosaic.maxGray;
+        pendingTransform.reset(rows, cols);
+        markModified();
+        return true;
+    }
+
+    // Function to Combine Image Side-by-side
+    void combineHorizontally(const Image& image2) {
+        if (!imageLoaded || !image2.imageLoaded) {
+            reportError("Error: One or more images not loaded.");
+            return;
+        }
+
+        if (rows != image2.rows) {
+            reportError("Error: Images must have the same height for horizontal combination.");
+            return;
+        }
+
+        arrangeGrid({ &image2 }, 2, 0, 0);
+
+        if (verbose)
+            cout << "Images combined horizontally." << endl;
+    }
+
+    // Function to Combine Image Top-to-bottom
+    void combineVertically(const Image& image2) {
+        if (!imageLoaded || !image2.imageLoaded) {
+            reportError("Error: One or more images not loaded.");
+            return;
+        }
+
+        if (cols != image2.cols) {
+            reportError("Error: Images must have the same width for vertical combination.");
             return;
         }
 
-        vector<vector<int>> rotatedImageData(cols, vector<int>(rows, 0));
+        arrangeGrid({ &image2 }, 1, 0, 0);
+
+        if (verbose)
+            cout << "Images combined vertically." << endl;
+    }
 
-        for (int i = 0; i < rows; ++i) {
-            for (int j = 0; j < cols; ++j) {
-                rotatedImageData[j][rows - 1 - i] = ImageData[i][j];
+    // Function to Arrange Images in a Grid
+    // This image is the first cell and others follow row by row, gridCols to a
+    // row, with padding pixels of the background value around every cell.
+    void composeGrid(const vector<const Image*>& others, int gridCols, int padding = 0, int background = 0) {
+        if (!imageLoaded) {
+            reportError("Error: Image not loaded.");
+            return;
+        }
+        for (const Image* other : others)
+            if (!other->imageLoaded) {
+                reportError("Error: One or more images not loaded.");
+                return;
             }
+
+        if (!arrangeGrid(others, gridCols, padding, background)) {
+            reportError("Error: Invalid grid layout.");
+            return;
+        }
+
+        if (verbose)
+            cout << "Images arranged in a grid of " << cols << "x" << rows << "." << endl;
+    }
+
+    // Function to Apply Mean Filter
+    // Box blur over a (2 * radiusX + 1) x (2 * radiusY + 1) window in constant
+    // time per pixel; pixels outside the image come from the border mode.
+    void applyMeanFilter(int radiusX = 1, int radiusY = 1, BorderMode border = BorderReplicate) {
+        if (!imageLoaded) {
+            reportError("Error: Image not loaded.");
+            return;
+        }
+
+        if (radiusX < 0 || radiusY < 0 || radiusX > 4096 || radiusY > 4096) {
+            reportError("Error: Mean filter radius must be between 0 and 4096.");
+            return;
+        }
+
+        recordUndo();
+        materialize();
+        ProfileScope scope("mean", "compute", static_cast<long long>(rows) * cols);
+
+        PixelBuffer filtered;
+        filtered.allocate(rows, cols, ImageData.bytesPerPixel, false);
+
+        dispatchPixels(ImageData.bytesPerPixel, [&](auto zero) {
+            using T = decltype(zero);
+            parallelRows(rows, rowBytes(), radiusY, [&](int rowBegin, int rowEnd) {
+                boxFilterRows<T>(ImageData, filtered, radiusX, radiusY, border, rowBegin, rowEnd);
+            });
+        });
+
+        ImageData = move(filtered);
+
+        if (verbose)
+            cout << "Mean filter applied." << endl;
+        markModified();
+    }
+
+    // Function to Apply Gaussian Blur
+    // Recursive approximation (see RecursiveGaussian), so the cost per pixel is
+    // the same for any sigma. Pixels past the border repeat the edge.
+    void applyGaussianBlur(double sigma) {
+        if (!imageLoaded) {
+            reportError("Error: Image not loaded.");
+            return;
         }
 
-        ImageData = rotatedImageData;
-        swap(rows, cols);
+        if (!(sigma >= 0.5 && sigma <= 1000)) {
+            reportError("Error: Sigma must be between 0.5 and 1000.");
+            return;
+        }
 
-        cout << "Image rotated 90 degrees clockwise." << endl;
-        imageModified = true;
+        recordUndo();
+        materialize();
+        ProfileScope scope("gaussian", "compute", static_cast<long long>(rows) * cols);
+
+        RecursiveGaussian gaussian(sigma);
+        PixelBuffer rowPass, filtered;
+        rowPass.allocate(rows, cols, sizeof(float), false);
+        filtered.allocate(rows, cols, ImageData.bytesPerPixel, false);
+
+        dispatchPixels(ImageData.bytesPerPixel, [&](auto zero) {
+            using T = decltype(zero);
+            parallelRows(rows, static_cast<size_t>(cols) * sizeof(float), 0, [&](int rowBegin, int rowEnd) {
+                gaussianRowPass<T>(ImageData, rowPass, gaussian, rowBegin, rowEnd);
+            });
+            // Strips of 64 columns, so no two tasks write the same cache line
+            const int stripCols = 64;
+            ThreadPool::instance().run((cols + stripCols - 1) / stripCols, [&](int s) {
+                gaussianColumnPass<T>(rowPass, filtered, gaussian, maxGray, s * stripCols, min(cols, (s + 1) * stripCols));
+            });
+        });
+
+        ImageData = move(filtered);
+
+        if (verbose)
+            cout << "Gaussian blur applied." << endl;
+        markModified();
     }
 
-    // Function to Rotate CounterClockwise
-    void rotate90CounterClockwise() {
+    // Function to Apply Median Filter
+    // Window of (2 * radius + 1)^2 pixels, radius 1 to 127. The sorting network
+    // handles radius 1-2 and the histogram algorithm everything larger, whose
+    // cost per pixel does not grow with the radius.
+    void applyMedianFilter(int radius = 1) {
         if (!imageLoaded) {
-            cout << "Error: Image not loaded." << endl;
+            reportError("Error: Image not loaded.");
             return;
         }
 
-        vector<vector<int>> rotatedImageData(cols, vector<int>(rows, 0));
-
-        for (int i = 0; i < rows; ++i) {
-            for (int j = 0; j < cols; ++j) {
-                rotatedImageData[cols - 1 - j][i] = ImageData[i][j];
-            }
+        if (radius < 1 || radius > 127) {
+            reportError("Error: Median radius must be between 1 and 127.");
+            return;
         }
 
-        ImageData = rotatedImageData;
-        swap(rows, cols);
+        recordUndo();
+        materialize();
+        ProfileScope scope("median", "compute", static_cast<long long>(rows) * cols);
 
-        cout << "Image rotated 90 degrees counterclockwise." << endl;
-        imageModified = true;
+        PixelBuffer filtered;
+        filtered.allocate(rows, cols, ImageData.bytesPerPixel, false);
+
+        dispatchPixels(ImageData.bytesPerPixel, [&](auto zero) {
+            using T = decltype(zero);
+            parallelRows(rows, rowBytes(), radius, [&](int rowBegin, int rowEnd) {
+                if (radius <= 2)
+                    medianNetworkRows<T>(ImageData, filtered, radius, rowBegin, rowEnd);
+                else
+                    medianHistogramRows<T>(ImageData, filtered, radius, rowBegin, rowEnd);
+            });
+        });
+
+        ImageData = move(filtered);
+
+        if (verbose)
+            cout << "Median filter applied." << endl;
+        markModified();
     }
 
-    // Function to Flip image Vertically
-    void flipVertical() {
+    // Function to Enhance Image by Applying Linear Filter
+    // The kernel file is "N [DIVISOR]" and N * N taps, N odd; the strategy is
+    // chosen from the kernel's rank and size unless one is requested.
+    void applyLinearFilter(const char* filterFileName, ConvolutionStrategy strategy = ConvolutionAuto) {
         if (!imageLoaded) {
-            cout << "Error: Image not loaded." << endl;
+            reportError("Error: Image not loaded.");
             return;
         }
-        for (int i = 0; i < rows / 2; ++i) {
-            for (int j = 0; j < cols; ++j) {
-                swap(ImageData[i][j], ImageData[rows - 1 - i][j]);
-            }
+
+        ConvolutionKernel kernel;
+        int loadResult = kernel.load(filterFileName);
+        if (loadResult == -1) {
+            reportError("Error: Unable to open filter file.");
+            return;
+        }
+        if (loadResult != 0) {
+            reportError("Error: Invalid filter file.");
+            return;
         }
+        kernel.plan(strategy);
+        recordUndo();
+        materialize();
+        ProfileScope scope(kernel.strategy == ConvolutionFFT ? "linear-fft" : "linear", "compute", static_cast<long long>(rows) * cols);
+
+        PixelBuffer filtered;
+        filtered.allocate(rows, cols, ImageData.bytesPerPixel, false);
+
+        dispatchPixels(ImageData.bytesPerPixel, [&](auto zero) {
+            using T = decltype(zero);
+            if (kernel.strategy == ConvolutionFFT) {
+                int tileRows = (rows + kernel.fftBlock - 1) / kernel.fftBlock;
+                parallelRows(tileRows, rowBytes() * kernel.fftBlock, 0, [&](int tileRowBegin, int tileRowEnd) {
+                    fftConvolutionTileRows<T>(ImageData, filtered, kernel, maxGray, tileRowBegin, tileRowEnd);
+                });
+            }
+            else
+                parallelRows(rows, rowBytes(), kernel.radius, [&](int rowBegin, int rowEnd) {
+                    convolutionRows<T>(ImageData, filtered, kernel, maxGray, rowBegin, rowEnd);
+                });
+        });
 
-        cout << "Image flipped vertically." << endl;
-        imageModified = true;
-    }
+        ImageData = move(filtered);
 
-    // Funtion to Flip image Horizontally
-    void horzontalFlipImage() {
-        for (int r = 0; r < rows / 2; r++)
-            for (int c = 0; c < cols; c++) {
-                int T = ImageData[r][c];
-                ImageData[r][c] = ImageData[rows - r][c];
-                ImageData[rows - r][c] = T;
-            }
-        return;
+        if (verbose)
+            cout << "Linear filter applied." << endl;
+        markModified();
     }
 
-    // Function to Translate Image
-    void translateImage(int deltaX, int deltaY) {
+    // Function to Compute Derivative
+    void applySobelX() {
         if (!imageLoaded) {
-            cout << "Error: Image not loaded." << endl;
+            reportError("Error: Image not loaded.");
             return;
         }
 
-        vector<vector<int>> translatedImageData(rows, vector<int>(cols, 0));
+        recordUndo();
+        materialize();
+        ProfileScope scope("sobel", "compute", static_cast<long long>(rows) * cols);
 
-        for (int i = 0; i < rows; ++i) {
-            for (int j = 0; j < cols; ++j) {
-                int newRow = i + deltaY;
-                int newCol = j + deltaX;
+        // Negative responses clamp to 0
+        PixelBuffer derivative;
+        derivative.allocate(rows, cols, ImageData.bytesPerPixel);
 
-                if (newRow >= 0 && newRow < rows && newCol >= 0 && newCol < cols) {
-                    translatedImageData[newRow][newCol] = ImageData[i][j];
-                }
-            }
-        }
+        dispatchPixels(ImageData.bytesPerPixel, [&](auto zero) {
+            using T = decltype(zero);
+            parallelRows(rows, rowBytes(), 1, [&](int rowBegin, int rowEnd) {
+                sobelGradientRows<T>(ImageData, derivative, nullptr, GradientL2, true, maxGray, rowBegin, rowEnd);
+            });
+        });
 
-        ImageData = translatedImageData;
+        ImageData = move(derivative);
 
-        cout << "Image translated by (" << deltaX << ", " << deltaY << ")." << endl;
-        imageModified = true;
+        if (verbose)
+            cout << "Sobel X filter applied (Derivative in the X direction)." << endl;
+        markModified();
     }
 
-    // Function to Scale Image
-    void scaleImage(double scaleFactor) {
+    // Function to Find Edges
+    // The magnitude is clamped to maxGray. If directions is given it is filled
+    // with an 8-bit image of quantized gradient directions (see gradientSector).
+    void findEdges(GradientNorm norm = GradientL2, PixelBuffer* directions = nullptr) {
         if (!imageLoaded) {
-            cout << "Error: Image not loaded." << endl;
+            reportError("Error: Image not loaded.");
             return;
         }
 
-        if (scaleFactor <= 0) {
-            cout << "Error: Invalid scaling factor." << endl;
-            return;
-        }
-
-        int newRows = static_cast<int>(rows * scaleFactor);
-        int newCols = static_cast<int>(cols * scaleFactor);
+        recordUndo();
+        materialize();
+        ProfileScope scope("edges", "compute", static_cast<long long>(rows) * cols);
 
-        vector<vector<int>> scaledImageData(newRows, vector<int>(newCols, 0));
+        PixelBuffer edgeMagnitude;
+        edgeMagnitude.allocate(rows, cols, ImageData.bytesPerPixel);
+        if (directions != nullptr)
+            directions->allocate(rows, cols, 1);
 
-        for (int i = 0; i < newRows; ++i) {
-            for (int j = 0; j < newCols; ++j) {
-                int originalRow = static_cast<int>(i / scaleFactor);
-                int originalCol = static_cast<int>(j / scaleFactor);
-                scaledImageData[i][j] = ImageData[originalRow][originalCol];
-            }
-        }
+        dispatchPixels(ImageData.bytesPerPixel, [&](auto zero) {
+            using T = decltype(zero);
+            parallelRows(rows, rowBytes(), 1, [&](int rowBegin, int rowEnd) {
+                sobelGradientRows<T>(ImageData, edgeMagnitude, directions, norm, false, maxGray, rowBegin, rowEnd);
+            });
+        });
 
-        ImageData = scaledImageData;
-        rows = newRows;
-        cols = newCols;
+        ImageData = move(edgeMagnitude);
 
-        cout << "Image scaled by a factor of " << scaleFactor << "." << endl;
-        imageModified = true;
+        if (verbose)
+            cout << "Edges detected using gradients." << endl;
+        markModified();
     }
 
-    // Function to Crop Image
-    void cropImage(int startX, int startY, int endX, int endY) {
+    // Function to Detect Edges with Canny
+    // Smooths with a Gaussian of the given sigma (0 skips it), thins the Sobel
+    // gradient to one pixel across each edge and keeps the pixels whose
+    // magnitude is at least high, plus those at least low that are 8-connected
+    // to one. Thresholds are in the units of the L2 findEdges output. The
+    // result is a packed binary mask, saved as 0 / maxGray.
+    void detectEdgesCanny(double sigma, int low, int high) {
         if (!imageLoaded) {
-            cout << "Error: Image not loaded." << endl;
+            reportError("Error: Image not loaded.");
             return;
         }
 
-        if (startX < 0 || startY < 0 || endX >= cols || endY >= rows || startX >= endX || startY >= endY) {
-            cout << "Invalid crop coordinates." << endl;
+        if (!(sigma >= 0 && sigma <= 20)) {
+            reportError("Error: Sigma must be between 0 and 20.");
             return;
         }
 
-        int newRows = endY - startY + 1;
-        int newCols = endX - startX + 1;
+        if (low < 0 || high < low) {
+            reportError("Error: Thresholds must satisfy 0 <= LOW <= HIGH.");
+            return;
+        }
 
-        vector<vector<int>> croppedImageData(newRows, vector<int>(newCols, 0));
+        recordUndo();
+        materialize();
+        ProfileScope scope("canny", "compute", static_cast<long long>(rows) * cols);
+
+        vector<float> taps = gaussianTaps(sigma);
+        BinaryMask strong;
+        mask.resize(rows, cols);
+        strong.resize(rows, cols);
+
+        dispatchPixels(ImageData.bytesPerPixel, [&](auto zero) {
+            using T = decltype(zero);
+            parallelRows(rows, rowBytes(), static_cast<int>(taps.size()) + 1, [&](int rowBegin, int rowEnd) {
+                cannyRows<T>(ImageData, taps, static_cast<long long>(low) * low, static_cast<long long>(high) * high,
+                    maxGray, mask, strong, rowBegin, rowEnd);
+            });
+        });
+
+        ComponentLabeling hysteresis;
+        hysteresis.keepSeeded(mask, strong, 8);
+        ImageData = PixelBuffer();
+
+        if (verbose)
+            cout << "Edges detected with Canny." << endl;
+        markModified();
+    }
+};
 
-        for (int i = 0; i < newRows; ++i) {
-            for (int j = 0; j < newCols; ++j) {
-                croppedImageData[i][j] = ImageData[startY + i][startX + j];
-            }
-        }
+// Function to Save Component Statistics
+// One CSV line per component after a header. Returns -1 if the file cannot be
+// opened and -2 on a write error; "-" writes to standard output.
+int writeComponentStats(const char* fileName, const vector<ComponentStats>& components) {
+    FILE* out = strcmp(fileName, "-") == 0 ? stdout : fopen(fileName, "w");
+    if (out == nullptr)
+        return -1;
+    if (out == stdout)
+        cout.flush();
+
+    fprintf(out, "label,area,left,top,right,bottom,centroid_x,centroid_y\n");
+    for (const ComponentStats& c : components)
+        fprintf(out, "%u,%lld,%d,%d,%d,%d,%.3f,%.3f\n", c.label, c.area, c.left, c.top, c.right, c.bottom,
+            static_cast<double>(c.sumX) / c.area, static_cast<double>(c.sumY) / c.area);
+
+    bool failed = ferror(out) != 0;
+    if (out == stdout)
+        failed = fflush(out) != 0 || failed;
+    else
+        failed = fclose(out) != 0 || failed;
+    return failed ? -2 : 0;
+}
 
-        ImageData = croppedImageData;
-        rows = newRows;
-        cols = newCols;
+// Function to Save a Grid of Images Without Building It
+// Same layout as Image::composeGrid, written band by band in the format of the
+// first image. Returns -1 if the file cannot be opened, -2 on a write error and
+// -3 for an invalid layout.
+int saveMosaic(const char* fileName, const vector<const Image*>& images, int gridCols, int padding = 0, int background = 0) {
+    Mosaic mosaic;
+    mosaic.gridCols = gridCols;
+    mosaic.padding = padding;
+    mosaic.background = background;
+
+    vector<PixelBuffer> rendered(images.size());
+    for (size_t k = 0; k < images.size(); k++) {
+        mosaic.cells.push_back(&images[k]->currentPixels(rendered[k]));
+        mosaic.maxGray = max(mosaic.maxGray, images[k]->maxGray);
+    }
+    if (!mosaic.layout())
+        return -3;
 
-        cout << "Image cropped." << endl;
-        imageModified = true;
+    FileWriter out;
+    if (strcmp(fileName, "-") == 0) {
+        cout.flush();
+        out.attach(1);
     }
+    else if (out.open(fileName) != 0)
+        return -1;
 
-    // Function to Combine Image Side-by-side
-    void combineHorizontally(const Image& image2) {
-        if (!imageLoaded || !image2.imageLoaded) {
-            cout << "Error: One or more images not loaded." << endl;
-            return;
-        }
+    ProfileScope scope("save-mosaic", "write", static_cast<long long>(mosaic.rows) * mosaic.cols);
+    if (!mosaic.write(out, strcmp(images[0]->MagicNumber, "P5") == 0) || out.close() != 0)
+        return -2;
+    return 0;
+}
 
-        if (rows != image2.rows) {
-            cout << "Error: Images must have the same height for horizontal combination." << endl;
-            return;
-        }
+// PIPELINE
+// Headless operation chain, e.g. "load a.pgm | contrast | sharpen | sobel | save out.pgm".
+// Steps are separated by '|' or new lines, '#' starts a comment and arguments
+// are whitespace separated (double quotes keep spaces in file names).
+struct PipelineStep {
+    string name;
+    vector<string> args;
+};
 
-        vector<vector<int>> combinedImageData(rows, vector<int>(cols + image2.cols, 0));
+struct PipelineOperation {
+    const char* name;
+    int minArgs, maxArgs;
+    const char* usage;
+};
+
+const PipelineOperation pipelineOperations[] = {
+    { "load", 1, 1, "load FILE" },
+    { "save", 1, 1, "save FILE|-" },
+    { "brightness", 1, 1, "brightness FACTOR" },
+    { "contrast", 0, 0, "contrast" },
+    { "sharpen", 0, 0, "sharpen" },
+    { "binary", 1, 2, "binary THRESHOLD [packed]" },
+    { "resize", 1, 2, "resize RATIO [auto|nearest|bilinear|bicubic|lanczos3|area]" },
+    { "rotate-cw", 0, 0, "rotate-cw" },
+    { "rotate-ccw", 0, 0, "rotate-ccw" },
+    { "flip-vertical", 0, 0, "flip-vertical" },
+    { "flip-horizontal", 0, 0, "flip-horizontal" },
+    { "translate", 2, 2, "translate DX DY" },
+    { "scale", 1, 2, "scale FACTOR [auto|nearest|bilinear|bicubic|lanczos3|area]" },
+    { "undo", 0, 0, "undo" },
+    { "redo", 0, 0, "redo" },
+    { "pyramid", 1, 1, "pyramid on|off    (resize and scale downscales start from a half-size level)" },
+    { "thumbnail", 2, 3, "thumbnail FACTOR FILE [FILTER]    (saves a scaled copy, image unchanged)" },
+    { "crop", 4, 4, "crop X0 Y0 X1 Y1" },
+    { "combine-h", 1, 1, "combine-h FILE" },
+    { "combine-v", 1, 1, "combine-v FILE" },
+    { "mosaic", 3, 1024, "mosaic COLUMNS PADDING BACKGROUND [FILE...]    (this image first, then FILEs)" },
+    { "save-mosaic", 5, 1024, "save-mosaic OUT|- COLUMNS PADDING BACKGROUND FILE...    (streamed, image unchanged)" },
+    { "mean", 0, 3, "mean [RADIUS_X [RADIUS_Y [replicate|reflect]]]" },
+    { "gaussian", 1, 1, "gaussian SIGMA    (0.5 to 1000, same cost for any sigma)" },
+    { "median", 0, 1, "median [RADIUS]" },
+    { "linear", 1, 2, "linear FILTER_FILE [auto|direct|separable|fft]" },
+    { "sobel", 0, 0, "sobel" },
+    { "edges", 0, 1, "edges [l2|l1|fast]" },
+    { "canny", 3, 3, "canny SIGMA LOW HIGH    (packed binary edge mask; thresholds on the edges scale)" },
+    { "label", 1, 2, "label STATS_FILE|- [8|4]    (label map; CSV of area, bounding box, centroid)" },
+    { "erode", 1, 3, "erode WIDTH [HEIGHT [rect|cross]]    (needs binary THRESHOLD packed)" },
+    { "dilate", 1, 3, "dilate WIDTH [HEIGHT [rect|cross]]" },
+    { "open", 1, 3, "open WIDTH [HEIGHT [rect|cross]]" },
+    { "close", 1, 3, "close WIDTH [HEIGHT [rect|cross]]" },
+};
 
-        for (int i = 0; i < rows; ++i) {
-            for (int j = 0; j < cols; ++j) {
-                combinedImageData[i][j] = ImageData[i][j];
+struct Pipeline {
+    vector<PipelineStep> steps;
+
+    // Returns 0, or -1 with a message on cerr for unknown steps or wrong arity
+    int parse(const string& text) {
+        steps.clear();
+        PipelineStep step;
+        string token;
+        bool inToken = false, quoted = false;
+
+        for (size_t i = 0; i <= text.size(); i++) {
+            char ch = i < text.size() ? text[i] : '\n';
+
+            if (quoted) {
+                if (ch == '"')
+                    quoted = false;
+                else
+                    token += ch;
+                continue;
             }
-        }
 
-        for (int i = 0; i < rows; ++i) {
-            for (int j = 0; j < image2.cols; ++j) {
-                combinedImageData[i][cols + j] = image2.ImageData[i][j];
+            if (ch == '#') {
+                while (i + 1 < text.size() && text[i + 1] != '\n')
+                    i++;
+                continue;
             }
-        }
 
-        ImageData = combinedImageData;
-        cols += image2.cols;
+            if (ch == '"') {
+                quoted = inToken = true;
+                continue;
+            }
 
-        cout << "Images combined horizontally." << endl;
-        imageModified = true;
-    }
+            if (ch == '|' || ch == '\n' || ch == ' ' || ch == '\t' || ch == '\r') {
+                if (inToken) {
+                    if (step.name.empty())
+                        step.name = token;
+                    else
+                        step.args.push_back(token);
+                    token.clear();
+                    inToken = false;
+                }
+                if ((ch == '|' || ch == '\n') && !step.name.empty()) {
+                    steps.push_back(step);
+                    step = PipelineStep();
+                }
+                continue;
+            }
 
-    // Function to Combine Image Top-to-bottom
-    void combineVertically(const Image& image2) {
-        if (!imageLoaded || !image2.imageLoaded) {
-            cout << "Error: One or more images not loaded." << endl;
-            return;
+            token += ch;
+            inToken = true;
         }
 
-        if (cols != image2.cols) {
-            cout << "Error: Images must have the same width for vertical combination." << endl;
-            return;
+        if (quoted) {
+            cerr << "pipeline: unterminated quote" << endl;
+            return -1;
         }
 
-        vector<vector<int>> combinedImageData(rows + image2.rows, vector<int>(cols, 0));
-
-        for (int i = 0; i < rows; ++i) {
-            for (int j = 0; j < cols; ++j) {
-                combinedImageData[i][j] = ImageData[i][j];
+        for (size_t i = 0; i < steps.size(); i++) {
+            const PipelineOperation* operation = findOperation(steps[i].name);
+            if (operation == nullptr) {
+                cerr << "pipeline: step " << i + 1 << ": unknown operation '" << steps[i].name << "'" << endl;
+                return -1;
             }
-        }
-
-        for (int i = 0; i < image2.rows; ++i) {
-            for (int j = 0; j < cols; ++j) {
-                combinedImageData[rows + i][j] = image2.ImageData[i][j];
+            int argCount = static_cast<int>(steps[i].args.size());
+            if (argCount < operation->minArgs || argCount > operation->maxArgs) {
+                cerr << "pipeline: step " << i + 1 << ": usage: " << operation->usage << endl;
+                return -1;
             }
         }
-
-        ImageData = combinedImageData;
-        rows += image2.rows;
-
-        cout << "Images combined vertically." << endl;
-        imageModified = true;
+        return 0;
     }
 
-    // Function to Apply Mean Filter
-    void applyMeanFilter() {
-        if (!imageLoaded) {
-            cout << "Error: Image not loaded." << endl;
-            return;
+    int loadFile(const char* fileName) {
+        MappedFile file;
+        if (file.open(fileName) != 0) {
+            cerr << "pipeline: cannot open " << fileName << endl;
+            return -1;
         }
+        return parse(string(file.data, file.size));
+    }
 
-        vector<vector<int>> filteredImageData(rows, vector<int>(cols, 0));
+    static const PipelineOperation* findOperation(const string& name) {
+        for (const PipelineOperation& operation : pipelineOperations)
+            if (name == operation.name)
+                return &operation;
+        return nullptr;
+    }
 
-        for (int i = 1; i < rows - 1; ++i) {
-            for (int j = 1; j < cols - 1; ++j) {
-                int sum = 0;
+    static bool isPointStep(const PipelineStep& step) {
+        return step.name == "brightness" || step.name == "contrast" || (step.name == "binary" && step.args.size() == 1);
+    }
 
-                for (int ni = -1; ni <= 1; ++ni) {
-                    for (int nj = -1; nj <= 1; ++nj) {
-                        sum += ImageData[i + ni][j + nj];
-                    }
+    // Runs every step on image with progress output off. Stops at the first
+    // failing step and returns its 1-based index, or 0 when all succeed; the
+    // error goes to cerr, or to failure when given.
+    // Consecutive point steps are fused into a single lookup-table pass.
+    int run(Image& image, string* failure = nullptr) {
+        image.verbose = false;
+
+        // Edit history is only kept when the chain can use it; then every
+        // point step stays separate so undo steps back exactly one of them
+        bool history = false;
+        for (const PipelineStep& step : steps)
+            history = history || step.name == "undo" || step.name == "redo";
+        image.undoLimit = history ? 16 : 0;
+
+        for (size_t i = 0; i < steps.size(); i++) {
+            image.lastError.clear();
+            string error;
+            size_t fused = i;
+            while (!history && fused < steps.size() && isPointStep(steps[fused]))
+                fused++;
+            ProfileScope scope(fused - i > 1 ? "point steps" : steps[i].name.c_str(), "step");
+
+            if (fused - i > 1) {
+                size_t failed = i;
+                error = runPointSteps(image, i, fused, failed);
+                scope.pixels = static_cast<long long>(image.rows) * image.cols;
+                if (error.empty()) {
+                    i = fused - 1;
+                    continue;
                 }
-
-                filteredImageData[i][j] = static_cast<int>(round(sum / 9.0));
+                i = failed;
+            }
+            else {
+                error = runStep(image, steps[i]);
+                scope.pixels = static_cast<long long>(image.rows) * image.cols;
+            }
+            if (error.empty())
+                error = image.lastError;
+            if (!error.empty()) {
+                string message = "step " + to_string(i + 1) + " (" + steps[i].name + "): " + error;
+                if (failure != nullptr)
+                    *failure = message;
+                else
+                    cerr << "pipeline: " << message << endl;
+                return static_cast<int>(i) + 1;
             }
         }
-
-        ImageData = filteredImageData;
-
-        cout << "Mean filter applied." << endl;
-        imageModified = true;
+        return 0;
     }
 
-    // Function to Apply Median Filter
-    void applyMedianFilter() {
-        if (!imageLoaded) {
-            cout << "Error: Image not loaded." << endl;
-            return;
-        }
-
-        vector<vector<int>> filteredImageData(rows, vector<int>(cols, 0));
+    static bool toDouble(const string& text, double& value) {
+        char* end = nullptr;
+        value = strtod(text.c_str(), &end);
+        return !text.empty() && *end == '\0';
+    }
 
-        for (int i = 1; i < rows - 1; ++i) {
-            for (int j = 1; j < cols - 1; ++j) {
-                vector<int> neighborhood;
+    static bool toFilter(const string& text, ResampleFilter& filter) {
+        const char* names[] = { "auto", "nearest", "bilinear", "bicubic", "lanczos3", "area" };
+        for (int k = 0; k < 6; k++)
+            if (text == names[k]) {
+                filter = static_cast<ResampleFilter>(k);
+                return true;
+            }
+        return false;
+    }
 
-                for (int ni = -1; ni <= 1; ++ni) {
-                    for (int nj = -1; nj <= 1; ++nj) {
-                        neighborhood.push_back(ImageData[i + ni][j + nj]);
-                    }
-                }
+    static bool toInt(const string& text, int& value) {
+        char* end = nullptr;
+        long result = strtol(text.c_str(), &end, 10);
+        value = static_cast<int>(result);
+        return !text.empty() && *end == '\0' && result >= INT_MIN && result <= INT_MAX;
+    }
 
-                sort(neighborhood.begin(), neighborhood.end());
-                filteredImageData[i][j] = neighborhood[4];
+    // Applies steps [first, last), all point operations, as one table. On
+    // failure the index of the step at fault is stored in failed.
+    string runPointSteps(Image& image, size_t first, size_t last, size_t& failed) {
+        vector<PointOperation> operations;
+        for (size_t i = first; i < last; i++) {
+            const PipelineStep& step = steps[i];
+            double number = 0;
+            int threshold = 0;
+            if (step.name == "contrast")
+                operations.push_back({ PointOperation::ContrastStretch, 0 });
+            else if (step.name == "brightness" && toDouble(step.args[0], number))
+                operations.push_back({ PointOperation::Brightness, number });
+            else if (step.name == "binary" && toInt(step.args[0], threshold))
+                operations.push_back({ PointOperation::Threshold, static_cast<double>(threshold) });
+            else {
+                failed = i;
+                return "invalid number '" + step.args[0] + "'";
             }
         }
 
-        ImageData = filteredImageData;
+        if (!image.imageLoaded) {
+            failed = first;
+            return "Error: Image not loaded.";
+        }
 
-        cout << "Median filter applied." << endl;
-        imageModified = true;
+        image.applyPointOperations(operations);
+        image.markModified();
+        return "";
     }
 
-    // Function to Enhance Image by Applying Linear Filter
-    void applyLinearFilter(const char* filterFileName) {
-        if (!imageLoaded) {
-            cout << "Error: Image not loaded." << endl;
-            return;
+    // Returns an error message for failures the Image methods do not report themselves
+    static string runStep(Image& image, const PipelineStep& step) {
+        const string& name = step.name;
+        const vector<string>& args = step.args;
+        double number = 0;
+        int values[4] = { 0, 0, 0, 0 };
+
+        if (name == "load") {
+            int errorCode = image.loadImage(args[0].c_str());
+            if (errorCode != 0)
+                return "Load Error: Code " + to_string(errorCode);
         }
-
-        ifstream filterFile(filterFileName);
-        if (!filterFile.is_open()) {
-            cout << "Error: Unable to open filter file." << endl;
-            return;
+        else if (name == "save") {
+            if (!image.imageLoaded)
+                return "Error: Image not loaded.";
+            int errorCode = image.saveImage(args[0].c_str());
+            if (errorCode != 0)
+                return "Save Error: Code " + to_string(errorCode);
+        }
+        else if (name == "brightness") {
+            if (!toDouble(args[0], number))
+                return "invalid number '" + args[0] + "'";
+            if (!image.imageLoaded)
+                return "Error: Image not loaded.";
+            image.changeBrightness(number);
+        }
+        else if (name == "contrast")
+            image.contrastStretching();
+        else if (name == "sharpen")
+            image.applySharpening();
+        else if (name == "binary") {
+            if (!toInt(args[0], values[0]))
+                return "invalid threshold '" + args[0] + "'";
+            if (args.size() > 1 && args[1] != "packed")
+                return "unknown option '" + args[1] + "'";
+            image.convertToBinary(values[0], args.size() > 1);
+        }
+        else if (name == "resize" || name == "scale") {
+            if (!toDouble(args[0], number))
+                return "invalid number '" + args[0] + "'";
+            ResampleFilter filter = ResampleAuto;
+            if (args.size() > 1 && !toFilter(args[1], filter))
+                return "unknown filter '" + args[1] + "'";
+            if (name == "resize")
+                image.resizeImage(number, filter);
+            else
+                image.scaleImage(number, filter);
+        }
+        else if (name == "pyramid") {
+            if (args[0] != "on" && args[0] != "off")
+                return "unknown option '" + args[0] + "'";
+            image.usePyramid = args[0] == "on";
+        }
+        else if (name == "undo")
+            image.undo();
+        else if (name == "redo")
+            image.redo();
+        else if (name == "thumbnail") {
+            ResampleFilter filter = ResampleAuto;
+            if (!toDouble(args[0], number) || number <= 0)
+                return "invalid factor '" + args[0] + "'";
+            if (args.size() > 2 && !toFilter(args[2], filter))
+                return "unknown filter '" + args[2] + "'";
+            if (!image.imageLoaded)
+                return "Error: Image not loaded.";
+            int errorCode = image.scaledCopy(number, filter).saveImage(args[1].c_str());
+            if (errorCode != 0)
+                return "Save Error: Code " + to_string(errorCode);
+        }
+        else if (name == "rotate-cw")
+            image.rotate90Clockwise();
+        else if (name == "rotate-ccw")
+            image.rotate90CounterClockwise();
+        else if (name == "flip-vertical")
+            image.flipVertical();
+        else if (name == "flip-horizontal") {
+            if (!image.imageLoaded)
+                return "Error: Image not loaded.";
+            image.horzontalFlipImage();
+        }
+        else if (name == "translate") {
+            if (!toInt(args[0], values[0]) || !toInt(args[1], values[1]))
+                return "translate expects integer offsets";
+            image.translateImage(values[0], values[1]);
+        }
+        else if (name == "crop") {
+            for (int i = 0; i < 4; i++)
+                if (!toInt(args[i], values[i]))
+                    return "crop expects integer coordinates";
+            image.cropImage(values[0], values[1], values[2], values[3]);
         }
+        else if (name == "combine-h" || name == "combine-v") {
+            Image image2;
+            int errorCode = image2.loadImage(args[0].c_str());
+            if (errorCode != 0)
+                return "Load Error: Code " + to_string(errorCode);
+            if (name == "combine-h")
+                image.combineHorizontally(image2);
+            else
+                image.combineVertically(image2);
+        }
+        else if (name == "mosaic" || name == "save-mosaic") {
+            size_t first = name == "mosaic" ? 0 : 1;
+            for (int i = 0; i < 3; i++)
+                if (!toInt(args[first + i], values[i]))
+                    return name + " expects integer COLUMNS PADDING BACKGROUND";
+            if (name == "mosaic" && !image.imageLoaded)
+                return "Error: Image not loaded.";
+
+            vector<Image> others(args.size() - first - 3);
+            vector<const Image*> cells;
+            for (size_t k = 0; k < others.size(); k++) {
+                int errorCode = others[k].loadImage(args[first + 3 + k].c_str());
+                if (errorCode != 0)
+                    return "Load Error: Code " + to_string(errorCode) + " (" + args[first + 3 + k] + ")";
+                cells.push_back(&others[k]);
+            }
 
-        int filterSize;
-        filterFile >> filterSize;
+            if (name == "mosaic")
+                image.composeGrid(cells, values[0], values[1], values[2]);
+            else {
+                int errorCode = saveMosaic(args[0].c_str(), cells, values[0], values[1], values[2]);
+                if (errorCode == -3)
+                    return "Error: Invalid grid layout.";
+                if (errorCode != 0)
+                    return "Save Error: Code " + to_string(errorCode);
+            }
+        }
+        else if (name == "mean") {
+            int radiusX = 1, radiusY = 1;
+            BorderMode border = BorderReplicate;
+            if (!args.empty() && !toInt(args[0], radiusX))
+                return "invalid radius '" + args[0] + "'";
+            radiusY = radiusX;
+            if (args.size() > 1 && !toInt(args[1], radiusY))
+                return "invalid radius '" + args[1] + "'";
+            if (args.size() > 2 && args[2] == "reflect")
+                border = BorderReflect;
+            else if (args.size() > 2 && args[2] != "replicate")
+                return "unknown border mode '" + args[2] + "'";
+            image.applyMeanFilter(radiusX, radiusY, border);
+        }
+        else if (name == "gaussian") {
+            if (!toDouble(args[0], number))
+                return "invalid sigma '" + args[0] + "'";
+            image.applyGaussianBlur(number);
+        }
+        else if (name == "median") {
+            int radius = 1;
+            if (!args.empty() && !toInt(args[0], radius))
+                return "invalid radius '" + args[0] + "'";
+            image.applyMedianFilter(radius);
+        }
+        else if (name == "linear") {
+            ConvolutionStrategy strategy = ConvolutionAuto;
+            if (args.size() > 1 && args[1] == "direct")
+                strategy = ConvolutionDirect;
+            else if (args.size() > 1 && args[1] == "separable")
+                strategy = ConvolutionSeparable;
+            else if (args.size() > 1 && args[1] == "fft")
+                strategy = ConvolutionFFT;
+            else if (args.size() > 1 && args[1] != "auto")
+                return "unknown strategy '" + args[1] + "'";
+            image.applyLinearFilter(args[0].c_str(), strategy);
+        }
+        else if (name == "sobel")
+            image.applySobelX();
+        else if (name == "edges") {
+            GradientNorm norm = GradientL2;
+            if (!args.empty() && args[0] == "l1")
+                norm = GradientL1;
+            else if (!args.empty() && args[0] == "fast")
+                norm = GradientFast;
+            else if (!args.empty() && args[0] != "l2")
+                return "unknown norm '" + args[0] + "'";
+            image.findEdges(norm);
+        }
+        else if (name == "canny") {
+            int low = 0, high = 0;
+            if (!toDouble(args[0], number))
+                return "invalid sigma '" + args[0] + "'";
+            if (!toInt(args[1], low) || !toInt(args[2], high))
+                return "invalid thresholds '" + args[1] + " " + args[2] + "'";
+            image.detectEdgesCanny(number, low, high);
+        }
+        else if (name == "label") {
+            int connectivity = 8;
+            if (args.size() > 1 && !toInt(args[1], connectivity))
+                return "invalid connectivity '" + args[1] + "'";
+            vector<ComponentStats> components;
+            if (image.labelComponents(connectivity, &components) >= 0) {
+                int errorCode = writeComponentStats(args[0].c_str(), components);
+                if (errorCode != 0)
+                    return "Save Error: Code " + to_string(errorCode);
+            }
+        }
+        else if (name == "erode" || name == "dilate" || name == "open" || name == "close") {
+            MorphologyOperation operation = name == "erode" ? MorphologyErode : name == "dilate" ? MorphologyDilate
+                : name == "open" ? MorphologyOpen : MorphologyClose;
+            MorphologyShape shape = MorphologyRect;
+            if (!toInt(args[0], values[0]))
+                return "invalid width '" + args[0] + "'";
+            values[1] = values[0];
+            if (args.size() > 1 && !toInt(args[1], values[1]))
+                return "invalid height '" + args[1] + "'";
+            if (args.size() > 2 && args[2] == "cross")
+                shape = MorphologyCross;
+            else if (args.size() > 2 && args[2] != "rect")
+                return "unknown structuring element '" + args[2] + "'";
+            image.applyMorphology(operation, shape, values[0], values[1]);
+        }
+        return "";
+    }
+};
 
-        vector<vector<int>> filter(filterSize, vector<int>(filterSize, 0));
+// BATCH
+// --batch INPUT OUTDIR "CHAIN" runs the chain on every matching file. INPUT is
+// a directory (all *.pgm files in it) or a path whose file name may hold * and
+// ? wildcards. Reader threads parse files, compute threads run the chain and
+// writer threads save the results under OUTDIR with the same file names. The
+// stages hand images over through bounded queues, so a slow stage holds the
+// ones before it back, and readers wait for room in the memory budget before
+// loading a file. Failures are reported per file and do not stop the batch.
+struct BatchSettings {
+    string input, outputDir, chain;
+    int readers = 1, jobs = 0, writers = 1;     // jobs 0: one per pool thread
+    long long memoryBudget = 1024LL << 20;
+};
 
-        for (int i = 0; i < filterSize; ++i) {
-            for (int j = 0; j < filterSize; ++j) {
-                filterFile >> filter[i][j];
-            }
+// Matches name against a pattern of literal characters, * and ?
+bool matchWildcard(const char* pattern, const char* name) {
+    const char* starPattern = nullptr;
+    const char* starName = nullptr;
+    while (*name != '\0') {
+        if (*pattern == '?' || (*pattern != '*' && *pattern == *name)) {
+            pattern++;
+            name++;
+        }
+        else if (*pattern == '*') {
+            starPattern = pattern++;
+            starName = name;
         }
+        else if (starPattern != nullptr) {
+            pattern = starPattern + 1;
+            name = ++starName;
+        }
+        else
+            return false;
+    }
+    while (*pattern == '*')
+        pattern++;
+    return *pattern == '\0';
+}
 
-        filterFile.close();
+// Lists the files matching input (see BATCH), sorted by name. Returns -1 if
+// the directory cannot be read.
+int listBatchFiles(const string& input, vector<string>& files) {
+    string directory = input, pattern = "*.pgm";
+    struct stat info;
+    if (stat(input.c_str(), &info) != 0 || (info.st_mode & S_IFMT) != S_IFDIR) {
+        size_t slash = input.find_last_of("/\\");
+        directory = slash == string::npos ? "." : input.substr(0, max<size_t>(slash, 1));
+        pattern = slash == string::npos ? input : input.substr(slash + 1);
+    }
 
-        vector<vector<int>> filteredImageData(rows, vector<int>(cols, 0));
+    vector<string> names;
+#ifdef _WIN32
+    _finddata_t entry;
+    intptr_t handle = _findfirst((directory + "\\*").c_str(), &entry);
+    if (handle == -1)
+        return -1;
+    do {
+        if (!(entry.attrib & _A_SUBDIR) && matchWildcard(pattern.c_str(), entry.name))
+            names.push_back(entry.name);
+    } while (_findnext(handle, &entry) == 0);
+    _findclose(handle);
+#else
+    DIR* dir = opendir(directory.c_str());
+    if (dir == nullptr)
+        return -1;
+    while (dirent* entry = readdir(dir)) {
+        string path = directory + "/" + entry->d_name;
+        if (matchWildcard(pattern.c_str(), entry->d_name) && stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode))
+            names.push_back(entry->d_name);
+    }
+    closedir(dir);
+#endif
 
-        int filterOffset = filterSize / 2;
-        for (int i = filterOffset; i < rows - filterOffset; ++i) {
-            for (int j = filterOffset; j < cols - filterOffset; ++j) {
-                int sum = 0;
+    sort(names.begin(), names.end());
+    files.clear();
+    for (const string& name : names)
+        files.push_back(directory + "/" + name);
+    return 0;
+}
 
-                for (int ni = -filterOffset; ni <= filterOffset; ++ni) {
-                    for (int nj = -filterOffset; nj <= filterOffset; ++nj) {
-                        sum += ImageData[i + ni][j + nj] * filter[ni + filterOffset][nj + filterOffset];
-                    }
-                }
+// Fixed-capacity queue between two stages. push blocks while the queue is
+// full; pop blocks while it is empty and returns false once every producer
+// has finished and the queue has drained.
+template <typename T>
+struct BoundedQueue {
+    mutex lock;
+    condition_variable notFull, notEmpty;
+    deque<T> items;
+    size_t capacity;
+    int producers;
+
+    BoundedQueue(size_t queueCapacity, int producerCount) : capacity(max<size_t>(queueCapacity, 1)), producers(producerCount) {}
+
+    void push(T item) {
+        unique_lock<mutex> guard(lock);
+        notFull.wait(guard, [this] { return items.size() < capacity; });
+        items.push_back(move(item));
+        notEmpty.notify_one();
+    }
 
-                filteredImageData[i][j] = sum;
-            }
-        }
+    bool pop(T& item) {
+        unique_lock<mutex> guard(lock);
+        notEmpty.wait(guard, [this] { return !items.empty() || producers == 0; });
+        if (items.empty())
+            return false;
+        item = move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void producerDone() {
+        lock_guard<mutex> guard(lock);
+        if (--producers == 0)
+            notEmpty.notify_all();
+    }
+};
 
-        ImageData = filteredImageData;
+// Bytes reserved by the images in flight. A request larger than the whole
+// budget is let through when nothing else is reserved, so it cannot stall.
+struct MemoryBudget {
+    mutex lock;
+    condition_variable released;
+    long long limit, used = 0;
 
-        cout << "Linear filter applied." << endl;
-        imageModified = true;
+    explicit MemoryBudget(long long bytes) : limit(bytes) {}
+
+    void acquire(long long bytes) {
+        unique_lock<mutex> guard(lock);
+        released.wait(guard, [&] { return used == 0 || used + bytes <= limit; });
+        used += bytes;
     }
 
-    // Function to Compute Derivative
-    void applySobelX() {
-        if (!imageLoaded) {
-            cout << "Error: Image not loaded." << endl;
-            return;
-        }
+    void release(long long bytes) {
+        lock_guard<mutex> guard(lock);
+        used -= bytes;
+        released.notify_all();
+    }
+};
 
-        vector<vector<int>> sobelXMask = { {-1, 0, 1},
-                                          {-2, 0, 2},
-                                          {-1, 0, 1} };
+struct BatchJob {
+    string path;
+    Image image;
+    long long reserved = 0;
+};
 
-        vector<vector<int>> derivativeImageData(rows, vector<int>(cols, 0));
+int runBatch(const BatchSettings& settings) {
+    Pipeline pipeline;
+    if (pipeline.parse(settings.chain) != 0)
+        return 2;
+    for (const PipelineStep& step : pipeline.steps)
+        if (step.name == "load" || step.name == "save") {
+            cerr << "batch: the chain must not " << step.name << "; files come from INPUT and go to OUTDIR" << endl;
+            return 2;
+        }
 
-        for (int i = 1; i < rows - 1; ++i) {
-            for (int j = 1; j < cols - 1; ++j) {
-                int sum = 0;
+    vector<string> files;
+    if (listBatchFiles(settings.input, files) != 0) {
+        cerr << "batch: cannot read " << settings.input << endl;
+        return 2;
+    }
+    if (files.empty()) {
+        cerr << "batch: no files match " << settings.input << endl;
+        return 2;
+    }
+#ifdef _WIN32
+    int made = _mkdir(settings.outputDir.c_str());
+#else
+    int made = mkdir(settings.outputDir.c_str(), 0777);
+#endif
+    if (made != 0 && errno != EEXIST) {
+        cerr << "batch: cannot create " << settings.outputDir << ": " << strerror(errno) << endl;
+        return 2;
+    }
+    struct stat outputInfo;
+    if (stat(settings.outputDir.c_str(), &outputInfo) != 0 || (outputInfo.st_mode & S_IFMT) != S_IFDIR) {
+        cerr << "batch: " << settings.outputDir << " is not a directory" << endl;
+        return 2;
+    }
 
-                for (int ni = -1; ni <= 1; ++ni) {
-                    for (int nj = -1; nj <= 1; ++nj) {
-                        sum += ImageData[i + ni][j + nj] * sobelXMask[ni + 1][nj + 1];
-                    }
-                }
+    int jobs = settings.jobs > 0 ? settings.jobs : ThreadPool::instance().threadCount();
+    BoundedQueue<BatchJob> computeQueue(2 * jobs, settings.readers);
+    BoundedQueue<BatchJob> writeQueue(2 * settings.writers, jobs);
+    MemoryBudget budget(settings.memoryBudget);
+    atomic<size_t> nextFile{ 0 };
+    atomic<int> failed{ 0 };
+    mutex reportLock;
+
+    auto reportFailure = [&](const string& path, const string& message) {
+        failed++;
+        lock_guard<mutex> guard(reportLock);
+        cerr << "batch: " << path << ": " << message << endl;
+    };
+
+    // Readers reserve the source, the result and one working copy
+    auto reader = [&]() {
+        for (size_t k = nextFile++; k < files.size(); k = nextFile++) {
+            BatchJob job;
+            job.path = files[k];
+
+            {
+                MappedFile file;
+                PGMHeader header;
+                if (file.open(job.path.c_str()) == 0 && parsePGMHeader(file.data, file.size, header) == 0)
+                    job.reserved = 3LL * header.rows * header.cols * bytesForMaxGray(header.maxGray);
+            }
+            budget.acquire(job.reserved);
 
-                derivativeImageData[i][j] = sum;
+            int errorCode = job.image.loadImage(job.path.c_str());
+            if (errorCode != 0) {
+                budget.release(job.reserved);
+                reportFailure(job.path, errorCode == -1 ? "cannot open file" : "not a valid PGM file");
+                continue;
             }
+            computeQueue.push(move(job));
         }
+        computeQueue.producerDone();
+    };
+
+    // With several compute threads each image runs sequentially on its own
+    // thread; a single compute thread spreads every image over the pool
+    auto computer = [&]() {
+        ThreadPool::insideTask() = jobs > 1;
+        BatchJob job;
+        while (computeQueue.pop(job)) {
+            string failure;
+            if (pipeline.run(job.image, &failure) != 0) {
+                budget.release(job.reserved);
+                reportFailure(job.path, failure);
+                continue;
+            }
+            writeQueue.push(move(job));
+        }
+        writeQueue.producerDone();
+    };
+
+    // OUTDIR may be the input directory: saveImage writes a temporary file and
+    // renames it over the source only once complete, so the mapped source of
+    // an image still in flight is never truncated
+    auto writer = [&]() {
+        BatchJob job;
+        while (writeQueue.pop(job)) {
+            string name = job.path.substr(job.path.find_last_of("/\\") + 1);
+            string output = settings.outputDir + "/" + name;
+            int errorCode = job.image.saveImage(output.c_str());
+            job.image = Image();
+            budget.release(job.reserved);
+            if (errorCode != 0)
+                reportFailure(job.path, errorCode == -1 ? "cannot create " + output : "write error on " + output);
+        }
+    };
+
+    vector<thread> threads;
+    for (int t = 0; t < settings.readers; t++)
+        threads.emplace_back(reader);
+    for (int t = 0; t < jobs; t++)
+        threads.emplace_back(computer);
+    for (int t = 0; t < settings.writers; t++)
+        threads.emplace_back(writer);
+    for (thread& worker : threads)
+        worker.join();
+
+    cerr << "batch: " << files.size() << " files, " << files.size() - failed << " written, " << failed << " failed" << endl;
+    return failed == 0 ? 0 : 1;
+}
 
-        ImageData = derivativeImageData;
-
-        cout << "Sobel X filter applied (Derivative in the X direction)." << endl;
-        imageModified = true;
+// Reads "--batch INPUT OUTDIR CHAIN [options]" starting at argv[first]
+int runBatchCommand(int argc, char* argv[], int first) {
+    if (argc - first < 3) {
+        cerr << "batch: expected INPUT OUTDIR \"CHAIN\"" << endl;
+        return 2;
     }
-
-    // Function to Find Edges
-    void findEdges() {
-        if (!imageLoaded) {
-            cout << "Error: Image not loaded." << endl;
-            return;
+    BatchSettings settings;
+    settings.input = argv[first];
+    settings.outputDir = argv[first + 1];
+    settings.chain = argv[first + 2];
+
+    for (int i = first + 3; i < argc; i += 2) {
+        string option = argv[i];
+        int value = 0;
+        bool valid = i + 1 < argc && Pipeline::toInt(argv[i + 1], value);
+        if (valid && option == "--readers" && value > 0)
+            settings.readers = value;
+        else if (valid && option == "--jobs" && value > 0)
+            settings.jobs = value;
+        else if (valid && option == "--writers" && value > 0)
+            settings.writers = value;
+        else if (valid && option == "--memory" && value > 0)
+            settings.memoryBudget = static_cast<long long>(value) << 20;
+        else {
+            cerr << "batch: invalid option " << option << (i + 1 < argc ? string(" ") + argv[i + 1] : string()) << endl;
+            return 2;
         }
+    }
+    return runBatch(settings);
+}
+
+// BENCHMARK
+// --bench times every Image operation on synthetic images and writes JSON.
+// Each measurement runs on a copy of the source image (cheap, the tiles are
+// shared), lazy geometric operations include the pass that renders them, and
+// load/save go through a scratch file in --tmp.
+struct BenchSettings {
+    vector<double> megapixels = { 0.25, 4, 25, 100 };
+    vector<int> bits = { 8, 16 };
+    vector<string> patterns = { "gradient", "noise", "text" };
+    vector<string> operations;      // empty: all
+    int warmup = 1, repeat = 5;
+    string outFile = "-", tmpDir = ".";
+};
+
+struct BenchOperation {
+    string name;
+    function<void(Image&)> run;
+};
 
-        // Sobel X mask
-        vector<vector<int>> sobelXMask = { {-1, 0, 1},
-                                          {-2, 0, 2},
-                                          {-1, 0, 1} };
+// Fills pixels with a horizontal/vertical ramp, uniform noise, or dark
+// 5 x 7 glyphs from random bitmaps on a light page with line gaps
+void fillBenchPattern(PixelBuffer& pixels, const string& pattern, int maxGray) {
+    uint32_t state = 12345;
+    auto next = [&state]() {
+        state = state * 1664525u + 1013904223u;
+        return state >> 8;
+    };
+    vector<uint32_t> glyphs(64);
+    for (uint32_t& glyph : glyphs)
+        glyph = next() | (next() << 24);
+
+    for (int r = 0; r < pixels.rows; r++)
+        for (int c = 0; c < pixels.cols; c++) {
+            int value;
+            if (pattern == "gradient")
+                value = static_cast<int>((static_cast<long long>(r + c) * maxGray) / max(1, pixels.rows + pixels.cols - 2));
+            else if (pattern == "noise")
+                value = static_cast<int>(next() % (maxGray + 1));
+            else {
+                int cellRow = r / 10, cellCol = c / 7, y = r % 10, x = c % 7;
+                uint32_t glyph = glyphs[(cellRow * 31 + cellCol * 17) & 63];
+                bool ink = y < 7 && x < 5 && ((glyph >> (y * 5 + x) % 32) & 1) && (cellCol % 9 != 8);
+                value = ink ? maxGray / 8 : maxGray - maxGray / 16;
+            }
+            if (pixels.bytesPerPixel == 1)
+                pixels.row<uint8_t>(r)[c] = static_cast<uint8_t>(value);
+            else
+                pixels.row<uint16_t>(r)[c] = static_cast<uint16_t>(value);
+        }
+}
 
-        // Sobel Y mask
-        vector<vector<int>> sobelYMask = { {-1, -2, -1},
-                                          {0, 0, 0},
-                                          {1, 2, 1} };
+inline double benchPercentile(const vector<double>& sorted, double q) {
+    size_t rank = static_cast<size_t>(ceil(q * sorted.size()));
+    return sorted[min(sorted.size() - 1, rank == 0 ? 0 : rank - 1)];
+}
 
-        vector<vector<int>> gradientX(rows, vector<int>(cols, 0));
-        vector<vector<int>> gradientY(rows, vector<int>(cols, 0));
+bool writeBenchKernel(const string& path, int size, bool gaussian) {
+    ofstream file(path);
+    if (!file.is_open())
+        return false;
+    if (gaussian) {
+        // Binomial rows make an exactly separable kernel
+        vector<double> row(1, 1.0);
+        for (int k = 1; k < size; k++) {
+            vector<double> longer(k + 1, 1.0);
+            for (int i = 1; i < k; i++)
+                longer[i] = row[i - 1] + row[i];
+            row = longer;
+        }
+        double total = pow(2.0, 2.0 * (size - 1));
+        file << size << " " << total << "\n";
+        for (int a = 0; a < size; a++) {
+            for (int b = 0; b < size; b++)
+                file << row[a] * row[b] << " ";
+            file << "\n";
+        }
+    }
+    else {
+        file << size << " " << size * size << "\n";
+        for (int k = 0; k < size * size; k++)
+            file << ((k * 7) % 5 == 0 ? 2 : 1) << (k % size == size - 1 ? "\n" : " ");
+    }
+    return static_cast<bool>(file);
+}
 
-        for (int i = 1; i < rows - 1; ++i) {
-            for (int j = 1; j < cols - 1; ++j) {
-                int sumX = 0;
-                int sumY = 0;
+int runBenchmark(const BenchSettings& settings) {
+    string scratch = settings.tmpDir + "/pgm_bench.pgm";
+    string kernel3 = settings.tmpDir + "/pgm_bench_k3.txt";
+    string kernel7 = settings.tmpDir + "/pgm_bench_k7.txt";
+    string kernel15 = settings.tmpDir + "/pgm_bench_k15.txt";
+    ofstream(kernel3) << "3\n0 -1 0\n-1 5 -1\n0 -1 0\n";
+    if (!writeBenchKernel(kernel7, 7, true) || !writeBenchKernel(kernel15, 15, false)) {
+        cerr << "bench: cannot write to " << settings.tmpDir << endl;
+        return 1;
+    }
 
-                // operation for Sobel X
-                for (int ni = -1; ni <= 1; ++ni) {
-                    for (int nj = -1; nj <= 1; ++nj) {
-                        sumX += ImageData[i + ni][j + nj] * sobelXMask[ni + 1][nj + 1];
+    vector<BenchOperation> operations = {
+        { "load-p2", [&](Image& image) { image.loadImage(scratch.c_str()); } },
+        { "load-p5", [&](Image& image) { image.loadImage(scratch.c_str()); } },
+        { "save-p2", [&](Image& image) { strcpy(image.MagicNumber, "P2"); image.saveImage(scratch.c_str()); } },
+        { "save-p5", [&](Image& image) { strcpy(image.MagicNumber, "P5"); image.saveImage(scratch.c_str()); } },
+        { "brightness", [](Image& image) { image.changeBrightness(1.2); } },
+        { "contrast", [](Image& image) { image.contrastStretching(); } },
+        { "binary", [](Image& image) { image.convertToBinary(image.maxGray / 2); } },
+        { "sharpen", [](Image& image) { image.applySharpening(); } },
+        { "resize-0.5", [](Image& image) { image.resizeImage(0.5); } },
+        { "resize-0.3-bilinear", [](Image& image) { image.resizeImage(0.3, ResampleBilinear); } },
+        { "scale-1.5-bicubic", [](Image& image) { image.scaleImage(1.5, ResampleBicubic); } },
+        { "scale-0.5-lanczos3", [](Image& image) { image.scaleImage(0.5, ResampleLanczos3); } },
+        { "rotate-cw", [](Image& image) { image.rotate90Clockwise(); image.materialize(); } },
+        { "rotate-ccw", [](Image& image) { image.rotate90CounterClockwise(); image.materialize(); } },
+        { "flip-vertical", [](Image& image) { image.flipVertical(); image.materialize(); } },
+        { "flip-horizontal", [](Image& image) { image.horzontalFlipImage(); image.materialize(); } },
+        { "translate", [](Image& image) { image.translateImage(17, -9); image.materialize(); } },
+        { "crop", [](Image& image) { image.cropImage(image.cols / 4, image.rows / 4, image.cols * 3 / 4, image.rows * 3 / 4); image.materialize(); } },
+        { "combine-h", [](Image& image) { Image other = image; image.combineHorizontally(other); } },
+        { "combine-v", [](Image& image) { Image other = image; image.combineVertically(other); } },
+        { "mosaic-3x3", [](Image& image) { Image other = image; image.composeGrid(vector<const Image*>(8, &other), 3, 4); } },
+        { "mean-3x3", [](Image& image) { image.applyMeanFilter(1, 1); } },
+        { "mean-15x15", [](Image& image) { image.applyMeanFilter(7, 7); } },
+        { "gaussian-1", [](Image& image) { image.applyGaussianBlur(1); } },
+        { "gaussian-50", [](Image& image) { image.applyGaussianBlur(50); } },
+        { "median-3x3", [](Image& image) { image.applyMedianFilter(1); } },
+        { "median-5x5", [](Image& image) { image.applyMedianFilter(2); } },
+        { "median-15x15", [](Image& image) { image.applyMedianFilter(7); } },
+        { "linear-3x3", [&](Image& image) { image.applyLinearFilter(kernel3.c_str()); } },
+        { "linear-7x7-separable", [&](Image& image) { image.applyLinearFilter(kernel7.c_str()); } },
+        { "linear-15x15-dense", [&](Image& image) { image.applyLinearFilter(kernel15.c_str()); } },
+        { "binary-packed", [](Image& image) { image.convertToBinary(image.maxGray / 2, true); } },
+        { "open-15x15-packed", [](Image& image) { image.convertToBinary(image.maxGray / 2, true);
+            image.applyMorphology(MorphologyOpen, MorphologyRect, 15, 15); } },
+        { "label-packed", [](Image& image) { image.convertToBinary(image.maxGray / 2, true);
+            image.labelComponents(8); } },
+        { "sobel", [](Image& image) { image.applySobelX(); } },
+        { "edges", [](Image& image) { image.findEdges(); } },
+        { "canny", [](Image& image) { image.detectEdgesCanny(1.4, image.maxGray / 8, image.maxGray / 3); } },
+    };
+
+    FILE* out = settings.outFile == "-" ? stdout : fopen(settings.outFile.c_str(), "w");
+    if (out == nullptr) {
+        cerr << "bench: cannot open " << settings.outFile << endl;
+        return 1;
+    }
+    fprintf(out, "{\n  \"threads\": %d,\n  \"warmup\": %d,\n  \"repeat\": %d,\n  \"results\": [",
+        ThreadPool::instance().threadCount(), settings.warmup, settings.repeat);
+
+    bool firstResult = true;
+    for (double megapixels : settings.megapixels)
+        for (int bits : settings.bits)
+            for (const string& pattern : settings.patterns) {
+                Image base;
+                base.verbose = false;
+                base.undoLimit = 0;
+                base.cols = max(1, static_cast<int>(sqrt(megapixels * 1e6 * 4.0 / 3.0) + 0.5));
+                base.rows = max(1, static_cast<int>(megapixels * 1e6 / base.cols + 0.5));
+                base.maxGray = bits == 8 ? 255 : 65535;
+                strcpy(base.MagicNumber, "P5");
+                base.ImageData.allocate(base.rows, base.cols, bytesForMaxGray(base.maxGray), false);
+                fillBenchPattern(base.ImageData, pattern, base.maxGray);
+                base.pendingTransform.reset(base.rows, base.cols);
+                base.imageLoaded = true;
+
+                for (const BenchOperation& operation : operations) {
+                    if (!settings.operations.empty()
+                        && find(settings.operations.begin(), settings.operations.end(), operation.name) == settings.operations.end())
+                        continue;
+                    cerr << "bench: " << megapixels << " MP " << bits << "-bit " << pattern << " " << operation.name << endl;
+
+                    // Loads read a file written in the matching format first
+                    if (operation.name == "load-p2" || operation.name == "load-p5") {
+                        Image writer = base;
+                        strcpy(writer.MagicNumber, operation.name == "load-p2" ? "P2" : "P5");
+                        writer.saveImage(scratch.c_str());
                     }
-                }
 
-                // operation for Sobel Y
-                for (int ni = -1; ni <= 1; ++ni) {
-                    for (int nj = -1; nj <= 1; ++nj) {
-                        sumY += ImageData[i + ni][j + nj] * sobelYMask[ni + 1][nj + 1];
+                    vector<double> times;
+                    for (int run = 0; run < settings.warmup + settings.repeat; run++) {
+                        Image image = base;
+                        auto start = chrono::steady_clock::now();
+                        operation.run(image);
+                        double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+                        if (!image.lastError.empty()) {
+                            cerr << "bench: " << operation.name << ": " << image.lastError << endl;
+                            break;
+                        }
+                        if (run >= settings.warmup)
+                            times.push_back(elapsed);
                     }
+                    if (times.empty())
+                        continue;
+
+                    sort(times.begin(), times.end());
+                    double total = 0;
+                    for (double t : times)
+                        total += t;
+                    double p50 = benchPercentile(times, 0.5);
+                    fprintf(out, "%s\n    { \"operation\": \"%s\", \"megapixels\": %g, \"bits\": %d, \"pattern\": \"%s\", "
+                        "\"cols\": %d, \"rows\": %d, \"samples\": %d, \"min_ms\": %.3f, \"p50_ms\": %.3f, \"p90_ms\": %.3f, "
+                        "\"p99_ms\": %.3f, \"max_ms\": %.3f, \"mean_ms\": %.3f, \"mpixels_per_s\": %.1f }",
+                        firstResult ? "" : ",", operation.name.c_str(), megapixels, bits, pattern.c_str(), base.cols, base.rows,
+                        static_cast<int>(times.size()), times.front(), p50, benchPercentile(times, 0.9),
+                        benchPercentile(times, 0.99), times.back(), total / times.size(),
+                        p50 > 0 ? static_cast<double>(base.rows) * base.cols / 1000.0 / p50 : 0.0);
+                    firstResult = false;
+                    fflush(out);
                 }
-
-                gradientX[i][j] = sumX;
-                gradientY[i][j] = sumY;
             }
-        }
 
-        vector<vector<int>> edgeMagnitude(rows, vector<int>(cols, 0));
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout)
+        fclose(out);
+    remove(scratch.c_str());
+    remove(kernel3.c_str());
+    remove(kernel7.c_str());
+    remove(kernel15.c_str());
+    return 0;
+}
 
-        for (int i = 1; i < rows - 1; ++i) {
-            for (int j = 1; j < cols - 1; ++j) {
-                edgeMagnitude[i][j] = static_cast<int>(round(sqrt(gradientX[i][j] * gradientX[i][j] +
-                    gradientY[i][j] * gradientY[i][j])));
+// Reads "--bench" options starting at argv[first]
+int runBenchCommand(int argc, char* argv[], int first) {
+    BenchSettings settings;
+    auto splitList = [](const string& text) {
+        vector<string> items;
+        string item;
+        istringstream stream(text);
+        while (getline(stream, item, ','))
+            if (!item.empty())
+                items.push_back(item);
+        return items;
+    };
+
+    for (int i = first; i < argc; i++) {
+        string option = argv[i];
+        if (i + 1 >= argc) {
+            cerr << "bench: " << option << " needs a value" << endl;
+            return 2;
+        }
+        string value = argv[++i];
+        bool valid = true;
+        if (option == "--sizes" || option == "--bits") {
+            vector<double> numbers;
+            for (const string& item : splitList(value)) {
+                double number = 0;
+                valid = valid && Pipeline::toDouble(item, number) && number > 0;
+                numbers.push_back(number);
+            }
+            if (option == "--sizes")
+                settings.megapixels = numbers;
+            else {
+                settings.bits.clear();
+                for (double number : numbers) {
+                    valid = valid && (number == 8 || number == 16);
+                    settings.bits.push_back(static_cast<int>(number));
+                }
             }
         }
+        else if (option == "--patterns") {
+            settings.patterns = splitList(value);
+            for (const string& pattern : settings.patterns)
+                valid = valid && (pattern == "gradient" || pattern == "noise" || pattern == "text");
+        }
+        else if (option == "--ops")
+            settings.operations = splitList(value);
+        else if (option == "--warmup")
+            valid = Pipeline::toInt(value, settings.warmup) && settings.warmup >= 0;
+        else if (option == "--repeat")
+            valid = Pipeline::toInt(value, settings.repeat) && settings.repeat > 0;
+        else if (option == "--out")
+            settings.outFile = value;
+        else if (option == "--tmp")
+            settings.tmpDir = value;
+        else
+            valid = false;
+
+        if (!valid) {
+            cerr << "bench: invalid option " << option << " " << value << endl;
+            return 2;
+        }
+    }
+    return runBenchmark(settings);
+}
 
-        ImageData = edgeMagnitude;
+// Command line entry: [--threads N] [--trace FILE] --run "CHAIN", --pipeline
+// FILE (FILE may be - for stdin), --batch INPUT OUTDIR "CHAIN" [OPTIONS] or
+// --bench [OPTIONS]
+int runCommandLine(int argc, char* argv[]) {
+    Pipeline pipeline;
+    int parseResult = -1;
+    int first = 1;
+
+    // Leading options, in any order
+    while (argc > first + 1) {
+        int threadCount = 0;
+        if (strcmp(argv[first], "--threads") == 0 && Pipeline::toInt(argv[first + 1], threadCount) && threadCount >= 0)
+            setThreadCount(static_cast<unsigned>(threadCount));
+        else if (strcmp(argv[first], "--trace") == 0)
+            Profiler::start(argv[first + 1]);
+        else
+            break;
+        first += 2;
+    }
 
-        cout << "Edges detected using gradients." << endl;
-        imageModified = true;
+    if (argc > first && strcmp(argv[first], "--bench") == 0)
+        return runBenchCommand(argc, argv, first + 1);
+    if (argc > first && strcmp(argv[first], "--batch") == 0)
+        return runBatchCommand(argc, argv, first + 1);
+
+    if (argc - first == 2 && strcmp(argv[first], "--run") == 0)
+        parseResult = pipeline.parse(argv[first + 1]);
+    else if (argc - first == 2 && strcmp(argv[first], "--pipeline") == 0) {
+        if (strcmp(argv[first + 1], "-") == 0) {
+            string text, line;
+            while (getline(cin, line))
+                text += line + "\n";
+            parseResult = pipeline.parse(text);
+        }
+        else
+            parseResult = pipeline.loadFile(argv[first + 1]);
     }
-};
+    else {
+        cerr << "Usage: " << argv[0] << "                      (interactive menu)\n"
+            << "       " << argv[0] << " [--threads N] --run \"load a.pgm | contrast | sharpen | save out.pgm\"\n"
+            << "       " << argv[0] << " [--threads N] --pipeline FILE|-\n"
+            << "       " << argv[0] << " [--threads N] --bench [--sizes 0.25,4,25,100] [--bits 8,16]\n"
+            << "             [--patterns gradient,noise,text] [--ops NAME,...] [--warmup N] [--repeat N]\n"
+            << "             [--out FILE] [--tmp DIR]\n"
+            << "       " << argv[0] << " [--threads N] --batch INPUT_DIR|\"DIR/*.pgm\" OUTDIR \"CHAIN\"\n"
+            << "             [--readers N] [--jobs N] [--writers N] [--memory MB]\n"
+            << "\n--threads N sets the worker thread count (default: one per core).\n"
+            << "--trace FILE (or PGM_TRACE=FILE) writes a Chrome trace and prints a profile at exit.\n\nOperations:\n";
+        for (const PipelineOperation& operation : pipelineOperations)
+            cerr << "  " << operation.usage << "\n";
+        return 2;
+    }
+
+    if (parseResult != 0)
+        return 2;
+
+    Image image;
+    return pipeline.run(image) == 0 ? 0 : 1;
+}
 
 // SHOW MENU
 struct Menu {
@@ -664,7 +6017,14 @@ struct Menu {
 
 };
 
-int main() {
+int main(int argc, char* argv[]) {
+    const char* traceFile = getenv("PGM_TRACE");
+    if (traceFile != nullptr && *traceFile != '\0')
+        Profiler::start(traceFile);
+
+    if (argc > 1)
+        return runCommandLine(argc, argv);
+
     char MenuFile[] = "MainMenu.txt";
     Image images[2];
     int activeImage = 0;
@@ -875,6 +6235,18 @@ int main() {
             cout << endl;
         }
 
+        // Older menu files end with Exit at 22, so these only apply when the
+        // menu lists them
+        else if (22 == userChoice && userChoice < totalChoices) {
+            images[activeImage].undo();
+            cout << endl;
+        }
+
+        else if (23 == userChoice && userChoice < totalChoices) {
+            images[activeImage].redo();
+            cout << endl;
+        }
+
 
     } while (userChoice != totalChoices);
     return 0;